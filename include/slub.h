@@ -2,22 +2,241 @@
 
 #include <list.h>
 
+#include <atomic>
 #include <cassert>
+#include <concepts>
 #include <cstddef>
 #include <cstdint>
+#include <mutex>
+#include <thread>
 #include <type_traits>
 
 namespace slub {
 
     constexpr size_t PAGE_SIZE      = 4096;
-    constexpr size_t PAGES_PER_SLAB = 1;
-    constexpr size_t SLAB_BYTES     = PAGE_SIZE * PAGES_PER_SLAB;
     constexpr size_t ALIGN          = 16;
-    constexpr int SLAB_KMAX = 2048;
+    constexpr size_t CACHE_LINE_SIZE = 64;
+
+    // Objects below SLAB_KMAX bytes are packed into slabs; bigger ones get
+    // a run of whole pages each. Override with -DSLUB_SLAB_KMAX=<bytes>.
+#ifndef SLUB_SLAB_KMAX
+#define SLUB_SLAB_KMAX (32 << 10)
+#endif
+    constexpr size_t SLAB_KMAX = SLUB_SLAB_KMAX;
+
+    // Slab sizing, as SLUB's calculate_order(): the smallest order, up to
+    // SLUB_MAX_ORDER, that holds SLUB_MIN_OBJECTS objects and wastes at most
+    // 1/16, else 1/8, else 1/4 of the slab on the tail and, if the provider
+    // keeps no slab descriptors, an on-slab header. A type no order suits
+    // takes the page-run path even below SLAB_KMAX.
+    constexpr size_t SLUB_MAX_ORDER   = 3;
+    constexpr size_t SLUB_MIN_OBJECTS = 8;
+
+    // Slabs taken from Buddy per refill; spares wait on the empty list.
+    constexpr size_t SLAB_REFILL_BATCH = 4;
+    // Empty slabs a cache keeps by default, like SLUB's min_partial; slabs
+    // that drain beyond it go back to the page provider.
+    constexpr size_t SLUB_MIN_PARTIAL = 5;
+
+    // Smallest order whose block covers `pages` pages.
+    constexpr size_t order_of_pages(size_t pages) {
+        size_t order = 0;
+        while ((size_t{1} << order) < pages) {
+            order++;
+        }
+        return order;
+    }
+
+    // Largest buddy block is 2^BUDDY_MAX_ORDER pages (4 MiB).
+    constexpr size_t BUDDY_MAX_ORDER   = 10;
+    constexpr size_t BUDDY_BLOCK_BYTES = PAGE_SIZE << BUDDY_MAX_ORDER;
+    constexpr size_t BUDDY_ARENA_BYTES = size_t{16} << 30;
+    constexpr size_t BUDDY_MAX_ARENAS  = 16;
+    // Runs of more pages are mapped directly, vmalloc-style: only virtually
+    // contiguous, and resized by Buddy::realloc_pages() with mremap() rather
+    // than a copy.
+    constexpr size_t BUDDY_VMAP_PAGES = size_t{1} << BUDDY_MAX_ORDER;
+    static_assert(BUDDY_VMAP_PAGES <= (size_t{1} << BUDDY_MAX_ORDER),
+                  "the arenas must serve every run up to the threshold");
+    // PMD-sized huge page; the arena base is aligned well past it.
+    constexpr size_t BUDDY_HUGE_PAGE_BYTES = size_t{2} << 20;
+    constexpr size_t BUDDY_HUGE_PAGE_ORDER =
+        order_of_pages(BUDDY_HUGE_PAGE_BYTES / PAGE_SIZE);
+    static_assert(BUDDY_HUGE_PAGE_ORDER <= BUDDY_MAX_ORDER,
+                  "a max-order block must cover a huge page");
+
+    // Anti-fragmentation: the arenas are carved into pageblocks, each holding
+    // one mobility class. Long-lived slab pages and short-lived reclaimable
+    // pages then fragment separate pageblocks instead of pinning each other's
+    // buddies. A class that runs dry steals, largest block first, from the
+    // other and claims whole pageblocks when the stolen block is big enough.
+    constexpr size_t BUDDY_PAGEBLOCK_ORDER = BUDDY_HUGE_PAGE_ORDER;
+    enum MigrateType : uint8_t {
+        MIGRATE_UNMOVABLE,
+        MIGRATE_RECLAIMABLE,
+        MIGRATE_TYPES
+    };
+
+    // GFP_ZERO runs of at least this size are zeroed with non-temporal
+    // stores, bypassing the cache; smaller runs use memset.
+    constexpr size_t BUDDY_STREAM_ZERO_BYTES = size_t{256} << 10;
+
+    // Per-thread page cache in front of the buddy free lists. Orders up to
+    // BUDDY_PCP_MAX_ORDER are refilled/drained BUDDY_PCP_BATCH pages at a time
+    // and a list is trimmed once it holds more than BUDDY_PCP_HIGH pages.
+    constexpr size_t BUDDY_PCP_MAX_ORDER = 3;
+    constexpr size_t BUDDY_PCP_BATCH     = 16;
+    constexpr size_t BUDDY_PCP_HIGH      = 64;
+
+    // When freed memory is handed back to the kernel. A free block that
+    // coalesces to at least `min_order` is released as soon as more than
+    // `retain_pages` of free memory is still resident; the retained pages
+    // absorb the next burst without page faults. `lazy` selects MADV_FREE
+    // (reclaimed only under memory pressure) over MADV_DONTNEED.
+    struct BuddyReleasePolicy {
+        size_t min_order    = BUDDY_MAX_ORDER - 1;
+        size_t retain_pages = (size_t{64} << 20) / PAGE_SIZE;
+        bool lazy           = false;
+    };
+
+    // How the arena is backed. TRANSPARENT asks for THP with MADV_HUGEPAGE;
+    // HUGETLB maps from the reserved hugetlbfs pool and falls back to
+    // TRANSPARENT when the pool cannot cover the arena. NONE uses 4 KiB pages.
+    enum class HugePageMode { NONE, TRANSPARENT, HUGETLB };
+
+    struct BuddyConfig {
+        // Total reservation, split evenly across the arenas. Halved until
+        // the mapping succeeds, down to one max-order block per arena.
+        size_t arena_bytes = BUDDY_ARENA_BYTES;
+        // 0 picks one arena per hardware thread, up to BUDDY_MAX_ARENAS.
+        size_t nr_arenas = 0;
+        HugePageMode huge_pages = HugePageMode::TRANSPARENT;
+        // Carve the arenas and their page descriptors out of this region
+        // instead of mapping memory; arena_bytes and huge_pages are ignored.
+        // Nothing is mapped, released or unmapped afterwards, and requests
+        // above the largest order fail. Align the region to
+        // BUDDY_BLOCK_BYTES to use all of it.
+        void *region        = nullptr;
+        size_t region_bytes = 0;
+        // mlock() the arenas at init, so the steady state takes no page
+        // faults. Locked memory is never released.
+        bool lock_pages = false;
+
+        bool operator==(const BuddyConfig &) const = default;
+    };
+
+    // Page budget, in pages charged to Buddy: everything taken off the free
+    // lists (per-thread caches included) plus direct mappings. Crossing
+    // `high_pages` runs the shrinkers until usage is back at `low_pages`;
+    // a request that still does not fit under `limit_pages` fails. 0 turns
+    // a mark off: without `high_pages` the limit is the high mark, and
+    // without `low_pages` the shrinkers free just enough for the request.
+    struct BuddyBudget {
+        size_t limit_pages = 0;
+        size_t high_pages  = 0;
+        size_t low_pages   = 0;
+    };
+
+    // Registered with Buddy::register_shrinker(). `shrink` should give back
+    // up to `nr_pages` pages and return how many it freed. It runs on the
+    // thread whose allocation crossed the high mark.
+    struct BuddyShrinker {
+        BuddyShrinker *prev{};
+        BuddyShrinker *next{};
+        size_t (*shrink)(void *ctx, size_t nr_pages) = nullptr;
+        void *ctx = nullptr;
+    };
+
+    // Snapshot of the buddy free lists, like /proc/buddyinfo.
+    struct BuddyInfo {
+        size_t nr_free[BUDDY_MAX_ORDER + 1]{};  // free blocks per order
+        size_t free_pages{};
+        size_t free_resident_pages{};
+        int largest_free_order = -1;  // -1 when nothing is free
+        size_t nr_pageblocks[MIGRATE_TYPES]{};  // pageblocks per class
+
+        // External fragmentation index for an allocation of `order`, as in
+        // Linux's extfrag_index: -1 when a suitable block exists, otherwise
+        // in [0, 1]; towards 0 a failure is due to lack of memory, towards 1
+        // it is due to fragmentation.
+        double fragmentation_index(size_t order) const {
+            size_t blocks_total = 0;
+            for (size_t o = 0; o <= BUDDY_MAX_ORDER; o++) {
+                blocks_total += nr_free[o];
+            }
+            if (blocks_total == 0) {
+                return 0;
+            }
+            if (largest_free_order >= static_cast<int>(order)) {
+                return -1;
+            }
+            const double requested = static_cast<double>(size_t{1} << order);
+            return 1 - (1 + free_pages / requested) / blocks_total;
+        }
+    };
+
+    // Allocation flags for Buddy::alloc_pages.
+    using gfp_t = unsigned;
+    constexpr gfp_t GFP_ZERO        = 1u << 0;  // caller needs zero-filled pages
+    constexpr gfp_t GFP_RECLAIMABLE = 1u << 1;  // short-lived, freed on demand
+
+    struct SlabHeader;
 
     struct Buddy {
-        static void *alloc_pages(size_t pages);
+        // Reserve the arenas up front. Optional: the first alloc_pages() call
+        // uses the default config if init() was never called, and retries
+        // it, at most every 10 ms, while it fails. Each thread
+        // allocates from its own arena under that arena's lock and steals
+        // from the others when it runs dry. A config other than the default
+        // (a region, locked pages) must be set before the first allocation:
+        // once initialised, init() returns false for any config but the one
+        // in effect.
+        static bool init(const BuddyConfig &config = {});
+        // Undo init(), so it can be called again with another config. Every
+        // page must have been freed and no other thread may cache pages.
+        static void shutdown();
+        static void *alloc_pages(size_t pages, gfp_t flags = 0);
         static void free_pages(void *p, size_t pages);
+        // Fill `out` with up to `count` blocks of `pages` pages each, taking
+        // each arena lock once. Returns how many were allocated.
+        static size_t alloc_pages_bulk(size_t pages, size_t count, void **out,
+                                       gfp_t flags = 0);
+        static void free_pages_bulk(void **ptrs, size_t count, size_t pages);
+        // Resize a run, keeping its contents. Directly mapped runs grow or
+        // shrink with mremap(), in place when the address space allows;
+        // a run that still fits its buddy block stays put. Returns nullptr,
+        // leaving `ptr` intact, on failure.
+        static void *realloc_pages(void *ptr, size_t old_pages,
+                                   size_t new_pages, gfp_t flags = 0);
+        // Give every page cached by the calling thread back to the buddy
+        // free lists. Also done automatically when a thread exits.
+        static void drain_local_pages();
+        // Zero free blocks on a background thread while the arenas are idle,
+        // so GFP_ZERO requests can skip the memset. The worker sleeps for
+        // `interval_ms` whenever it finds nothing to zero.
+        static bool start_prezero(unsigned interval_ms = 10);
+        static void stop_prezero();
+        static size_t get_prezeroed_pages();
+        static void set_budget(const BuddyBudget &budget);
+        static BuddyBudget get_budget();
+        // Pages currently charged against the budget.
+        static size_t get_used_pages();
+        static void register_shrinker(BuddyShrinker &shrinker);
+        static void unregister_shrinker(BuddyShrinker &shrinker);
+        // Run the shrinkers by hand. Returns the number of pages they freed.
+        static size_t shrink(size_t nr_pages);
+        static void set_release_policy(const BuddyReleasePolicy &policy);
+        // Release free blocks to the kernel until at most `keep_pages` free
+        // pages remain resident. Returns the number of pages released.
+        static size_t release_free_pages(size_t keep_pages = 0);
+        static size_t get_free_resident_pages();
+        // Backing actually in effect after init().
+        static HugePageMode get_huge_page_mode();
+        // Free-list snapshot of every arena combined, or of one arena. Only
+        // takes each arena lock briefly, so it is cheap enough to sample.
+        static BuddyInfo get_buddyinfo();
+        static BuddyInfo get_buddyinfo(size_t arena);
+        static size_t get_nr_arenas();
         static size_t get_current_pages();
         static size_t get_total_allocated_pages();
         static double get_alloc_time_ms();
@@ -25,6 +244,19 @@ namespace slub {
         static size_t get_alloc_count();
         static size_t get_free_count();
         static void reset_timers();
+        // Per-call timing is only compiled in with SLUB_BUDDY_TIMING=1; it
+        // can then be switched off at runtime.
+        static void set_timing(bool enabled);
+        static bool timing_enabled();
+        // Slab descriptor of the page holding `p`, or nullptr outside the
+        // arenas. Kept in a table beside the page descriptors, one per page,
+        // so slabs carry no header and any page maps to its slab in O(1).
+        static SlabHeader *virt_to_slab(const void *p);
+
+    private:
+        static inline std::uintptr_t slab_base_ = 0;
+        static inline size_t slab_pages_        = 0;
+        static inline SlabHeader *slab_map_     = nullptr;
     };
 
     struct SlubStats {
@@ -45,26 +277,259 @@ namespace slub {
         return (addr + align - 1) & ~(align - 1);
     }
 
+    // A pointer and a counter that are swapped together with one
+    // double-width compare-and-swap, like the kernel's cmpxchg_double. Every
+    // update changes the counter, so a pair that still compares equal was
+    // not touched in between, however the pointer moved meanwhile (no ABA).
+    struct alignas(16) FreelistPair {
+        void *freelist;
+        uint64_t counters;
+    };
+
+    // Either word may be read while the other changes; the caller validates
+    // the pair with cmpxchg_double.
+    static inline FreelistPair load_pair(const FreelistPair *p) {
+        FreelistPair v;
+        v.counters = __atomic_load_n(&p->counters, __ATOMIC_ACQUIRE);
+        v.freelist = __atomic_load_n(&p->freelist, __ATOMIC_ACQUIRE);
+        return v;
+    }
+
+    // On failure `expected` is updated to what the pair holds now.
+    static inline bool cmpxchg_double(FreelistPair *p, FreelistPair &expected,
+                                      FreelistPair desired) {
+#if defined(__x86_64__) && !defined(__SANITIZE_THREAD__)
+        // GCC routes 16-byte __atomic builtins through libatomic; the
+        // instruction itself is what we want on the fast path.
+        bool ok;
+        asm volatile("lock cmpxchg16b %1"
+                     : "=@ccz"(ok), "+m"(*p), "+a"(expected.freelist),
+                       "+d"(expected.counters)
+                     : "b"(desired.freelist), "c"(desired.counters)
+                     : "memory");
+        return ok;
+#else
+        // TSan cannot see into the asm; the builtin keeps it informed.
+        return __atomic_compare_exchange(p, &expected, &desired, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+    }
+
+    // What kfree() needs to know of a cache without its type: who frees an
+    // object, and how big objects are.
+    struct SlabCache {
+        void (*free)(void *ctx, void *ptr) = nullptr;
+        void *ctx                          = nullptr;
+        size_t object_size                 = 0;
+    };
+
     struct SlabHeader {
-        enum class SlabState { EMPTY, PARTIAL, FULL };
+        // FROZEN: owned by a cpu slot, as its active slab or on its partial
+        // list (linked through `next`), and on no node list. An active slab's
+        // free objects are on the slot's freelist; `objects` only collects
+        // objects that other slots free meanwhile.
+        // FULL: every object handed out. On no list either: the first thread
+        // to free to it freezes it onto its own slot's partial list.
+        enum class SlabState : uint8_t { EMPTY, PARTIAL, FULL, FROZEN };
         SlabHeader *prev{};
         SlabHeader *next{};
-        void *freelist{};
-        size_t inuse{};
-        size_t total{};
+        // The slab's own freelist, with the objects in use in the low half
+        // of `counters` and SLAB_FROZEN above it. Changed only through
+        // cmpxchg_double, so a thread frees to a slab it does not own
+        // without a lock, and only takes node_lock_ to move it between lists.
+        FreelistPair objects{};
+        // Head page of the slab, set in every page's descriptor so kfree()
+        // gets from any object to its slab.
+        SlabHeader *head{};
+        // Owner, for kfree(); nullptr once the pages go back.
+        SlabCache *cache{};
+        void *base{};  // first page
+        uint32_t total{};
         SlabState state{};
         SlabHeader()
             : prev(nullptr),
               next(nullptr),
-              freelist(nullptr),
-              state(SlabState::EMPTY),
-              inuse(0),
-              total(0) {}
+              objects{nullptr, 0},
+              head(nullptr),
+              cache(nullptr),
+              base(nullptr),
+              total(0),
+              state(SlabState::EMPTY) {}
     };
 
+    static_assert(sizeof(SlabHeader) == CACHE_LINE_SIZE,
+                  "one slab descriptor per page should stay a cache line");
+
+    inline SlabHeader *Buddy::virt_to_slab(const void *p) {
+        const size_t pfn =
+            (reinterpret_cast<std::uintptr_t>(p) - slab_base_) / PAGE_SIZE;
+        return pfn < slab_pages_ ? &slab_map_[pfn] : nullptr;
+    }
+
+    constexpr uint64_t SLAB_FROZEN = uint64_t{1} << 32;
+
+    static inline uint32_t slab_inuse(uint64_t counters) {
+        return static_cast<uint32_t>(counters);
+    }
+
     static_assert(util::IntrusiveListNodeTrait<SlabHeader>,
                   "SlabHeader fails to be a valid intrusive list node");
 
+    // Objects of `size` bytes, aligned to `align`, that fit in a slab of
+    // `order` after a `header` of that many bytes.
+    constexpr size_t slab_objects(size_t order, size_t size, size_t align,
+                                  size_t header) {
+        const size_t first = (header + align - 1) & ~(align - 1);
+        const size_t bytes = PAGE_SIZE << order;
+        return bytes > first ? (bytes - first) / size : 0;
+    }
+
+    // Smallest order up to `max_order` that holds `min_objects` and leaves
+    // at most 1/`fract_leftover` of the slab unused; max_order + 1 if none.
+    constexpr size_t slab_order(size_t size, size_t align, size_t header,
+                                size_t min_objects, size_t max_order,
+                                size_t fract_leftover) {
+        for (size_t order = 0; order <= max_order; order++) {
+            const size_t bytes   = PAGE_SIZE << order;
+            const size_t objects = slab_objects(order, size, align, header);
+            if (objects >= min_objects &&
+                bytes - objects * size <= bytes / fract_leftover)
+            {
+                return order;
+            }
+        }
+        return max_order + 1;
+    }
+
+    // Like SLUB's calculate_order(): ask for fewer objects per slab, and
+    // accept more waste, until an order within SLUB_MAX_ORDER qualifies.
+    // SLUB_MAX_ORDER + 1 when none does.
+    constexpr size_t calculate_order(size_t size, size_t align,
+                                     size_t header) {
+        for (size_t min_objects = SLUB_MIN_OBJECTS; min_objects > 0;
+             min_objects /= 2)
+        {
+            for (size_t fract_leftover : {16, 8, 4}) {
+                const size_t order =
+                    slab_order(size, align, header, min_objects,
+                               SLUB_MAX_ORDER, fract_leftover);
+                if (order <= SLUB_MAX_ORDER) {
+                    return order;
+                }
+            }
+        }
+        return SLUB_MAX_ORDER + 1;
+    }
+
+    static_assert(
+        [] {
+            for (size_t size = sizeof(void *); size <= 256;
+                 size += sizeof(void *))
+            {
+                if (calculate_order(size, alignof(void *), 0) != 0 ||
+                    calculate_order(size, alignof(void *),
+                                    sizeof(SlabHeader)) != 0)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }(),
+        "objects up to 256 bytes keep single-page slabs");
+    static_assert(calculate_order(512, 8, sizeof(SlabHeader)) == 1 &&
+                      calculate_order(768, 8, sizeof(SlabHeader)) == 1 &&
+                      calculate_order(1024, 8, sizeof(SlabHeader)) == 2 &&
+                      slab_objects(2, 1024, 8, sizeof(SlabHeader)) == 15,
+                  "with an on-slab header, 512-768 bytes take order 1 and "
+                  "1 KiB order 2, 15 objects a slab");
+
+    // Layout of every slab of a cache with objects of `Size` bytes aligned
+    // to `Align`, after `Header` bytes of on-slab header (0 when off-slab),
+    // settled at compile time.
+    template <size_t Size, size_t Align, size_t Header>
+    struct SlabGeometry {
+        static constexpr size_t order = calculate_order(Size, Align, Header);
+        static constexpr size_t pages = size_t{1} << order;
+        static constexpr size_t bytes = PAGE_SIZE << order;
+        // Offset of the first object, and how many follow it.
+        static constexpr size_t first_offset =
+            (Header + Align - 1) & ~(Align - 1);
+        static constexpr size_t objects =
+            slab_objects(order, Size, Align, Header);
+        // Bytes left over at the end of the slab.
+        static constexpr size_t waste = bytes - first_offset - objects * Size;
+        // Colouring, as in SLAB: successive slabs move their objects
+        // `colour_off` bytes further in, through `colours` offsets in all,
+        // so the same object index of different slabs spreads over cache
+        // sets. Paid for out of `waste`.
+        static constexpr size_t colour_off = std::max(Align, CACHE_LINE_SIZE);
+        static constexpr size_t colours    = waste / colour_off + 1;
+
+        static_assert(order <= SLUB_MAX_ORDER,
+                      "types no slab order suits are HugeObjectType");
+        static_assert(objects > 0 && objects < SLAB_FROZEN,
+                      "the inuse counter must cover every object of a slab");
+        static_assert(waste <= bytes / 4,
+                      "calculate_order() leaves at most 1/4 of a slab unused");
+        static_assert(first_offset + (colours - 1) * colour_off +
+                              objects * Size <=
+                          bytes,
+                      "the last colour must still fit every object");
+    };
+
+    // Test-and-test-and-set lock for the cpu slots, whose critical sections
+    // are short: list moves, at most under the node lock, and never a call
+    // into the page provider. Yields after a while in case the holder was
+    // preempted.
+    class SpinLock {
+    public:
+        void lock() {
+            for (unsigned spins = 0;
+                 locked_.exchange(true, std::memory_order_acquire);)
+            {
+                while (locked_.load(std::memory_order_relaxed)) {
+                    if (++spins % 64 == 0) {
+                        std::this_thread::yield();
+                    }
+#if defined(__x86_64__) || defined(__i386__)
+                    __builtin_ia32_pause();
+#endif
+                }
+            }
+        }
+        bool try_lock() {
+            return !locked_.load(std::memory_order_relaxed) &&
+                   !locked_.exchange(true, std::memory_order_acquire);
+        }
+        void unlock() {
+            locked_.store(false, std::memory_order_release);
+        }
+
+    private:
+        std::atomic<bool> locked_{false};
+    };
+
+    // Every cache has SLUB_CPU_SLOTS cpu slots. A thread takes the next slot
+    // round-robin the first time it allocates and keeps it; threads beyond
+    // SLUB_CPU_SLOTS share slots.
+    constexpr size_t SLUB_CPU_SLOTS = 16;
+    inline std::atomic<size_t> g_next_cpu_slot{0};
+    // Constant-initialised, so reading it needs no TLS init guard.
+    inline thread_local size_t t_cpu_slot = SLUB_CPU_SLOTS;
+
+    // Partial slabs a cpu slot keeps for itself by default, like SLUB's
+    // cpu_partial; see SlubAllocator::set_cpu_partial().
+    constexpr size_t SLUB_CPU_PARTIAL_SLABS = 8;
+
+    static inline size_t this_cpu_slot() {
+        if (t_cpu_slot == SLUB_CPU_SLOTS) [[unlikely]] {
+            t_cpu_slot =
+                g_next_cpu_slot.fetch_add(1, std::memory_order_relaxed) %
+                SLUB_CPU_SLOTS;
+        }
+        return t_cpu_slot;
+    }
+
     template <typename ObjType>
     struct size_of_type
         : public std::integral_constant<size_t, sizeof(ObjType)> {};
@@ -73,91 +538,282 @@ namespace slub {
     struct align_of_type
         : public std::integral_constant<size_t, alignof(ObjType)> {};
 
-    template <typename ObjType>
-    concept HugeObjectType = (size_of_type<ObjType>::value >= SLAB_KMAX);
+    // Free-list next pointer is stored in object body, so a slab object's
+    // size/alignment must be at least pointer-sized/pointer-aligned, and the
+    // size a multiple of the alignment.
+    constexpr size_t slab_obj_align(size_t align) {
+        return std::max(align, alignof(void *));
+    }
+    constexpr size_t slab_obj_size(size_t size, size_t align) {
+        const size_t obj_align = slab_obj_align(align);
+        return (std::max(size, sizeof(void *)) + obj_align - 1) &
+               ~(obj_align - 1);
+    }
 
-    template <typename ObjType>
+    // Whether objects of `size` bytes aligned to `align` are packed into
+    // slabs with `header` bytes of on-slab header, or get page runs.
+    constexpr bool slab_suits(size_t size, size_t align, size_t header) {
+        return size < SLAB_KMAX &&
+               calculate_order(slab_obj_size(size, align),
+                               slab_obj_align(align),
+                               header) <= SLUB_MAX_ORDER;
+    }
+
+    // Where a SlubAllocator gets its pages. Blocks of `pages` pages must be
+    // aligned to `pages` rounded up to a power of two, as Buddy hands them
+    // out, because a slab is found by masking an object's address. The
+    // calls are static, so a provider costs no indirection on the fast path;
+    // a backing with state keeps it in static members of its own type.
+    // Bulk allocation, shrinker registration and slab descriptors are
+    // optional.
+    //
+    // Pages given back with free_pages() must stay mapped and readable. The
+    // lockless alloc() may still read a free link in a slab that a flush on
+    // another thread has just discarded; it throws the value away when its
+    // cmpxchg fails, but the load itself must not fault. Buddy never unmaps
+    // its arenas. A backing that munmap()s, or hands memory to the C heap
+    // that may give it back to the kernel, has to keep freed pages mapped
+    // instead, e.g. by recycling them itself.
+    template <typename Provider>
+    concept PageProvider = requires(void *p, size_t pages, gfp_t flags) {
+        { Provider::alloc_pages(pages, flags) } -> std::same_as<void *>;
+        Provider::free_pages(p, pages);
+    };
+
+    template <typename Provider>
+    concept BulkPageProvider =
+        PageProvider<Provider> &&
+        requires(size_t pages, size_t count, void **out) {
+            { Provider::alloc_pages_bulk(pages, count, out) }
+                -> std::same_as<size_t>;
+        };
+
+    template <typename Provider>
+    concept ShrinkablePageProvider =
+        PageProvider<Provider> && requires(BuddyShrinker &shrinker) {
+            Provider::register_shrinker(shrinker);
+            Provider::unregister_shrinker(shrinker);
+        };
+
+    // A provider with a slab descriptor per page, as Buddy::virt_to_slab().
+    // Its slabs are all objects, and their objects can go to kfree();
+    // other providers' slabs start with their SlabHeader.
+    template <typename Provider>
+    concept SlabDescPageProvider =
+        PageProvider<Provider> && requires(const void *p) {
+            { Provider::virt_to_slab(p) } -> std::same_as<SlabHeader *>;
+        };
+
+    template <typename Provider>
+    constexpr size_t slab_header_bytes =
+        SlabDescPageProvider<Provider> ? 0 : sizeof(SlabHeader);
+
+    // Decided on the same rounded size SlubAllocator lays its slabs out
+    // with.
+    template <typename ObjType, typename Provider = Buddy>
+    concept HugeObjectType = !slab_suits(size_of_type<ObjType>::value,
+                                         align_of_type<ObjType>::value,
+                                         slab_header_bytes<Provider>);
+
+    static_assert(BulkPageProvider<Buddy> && ShrinkablePageProvider<Buddy> &&
+                  SlabDescPageProvider<Buddy>);
+
+    // Free an object of any cache whose provider keeps slab descriptors,
+    // or a page-run object of Buddy's arenas, without naming its type.
+    void kfree(void *ptr);
+    // Usable size of such an object.
+    size_t ksize(const void *ptr);
+
+    template <typename ObjType, PageProvider Provider = Buddy>
     class SlubAllocator {
     protected:
         static constexpr size_t raw_obj_size_  = size_of_type<ObjType>::value;
         static constexpr size_t raw_obj_align_ = align_of_type<ObjType>::value;
 
-        static constexpr size_t ptr_size_  = sizeof(void *);
-        static constexpr size_t ptr_align_ = alignof(void *);
-        // Round up n to multiple of align; align must be power-of-two.
-        static constexpr size_t round_up_pow2(size_t n, size_t align) {
-            return (n + align - 1) & ~(align - 1);
-        }
-
-        // Free-list next pointer is stored in object body, so size/alignment
-        // must be at least pointer-sized/pointer-aligned.
-        static constexpr size_t obj_align_ =
-            std::max(raw_obj_align_, ptr_align_);
+        static constexpr size_t obj_align_ = slab_obj_align(raw_obj_align_);
         static constexpr size_t obj_size_ =
-            round_up_pow2(std::max(raw_obj_size_, ptr_size_), obj_align_);
-
-        constexpr static size_t pages_      = PAGES_PER_SLAB;
-        constexpr static size_t slab_bytes_ = SLAB_BYTES;
+            slab_obj_size(raw_obj_size_, raw_obj_align_);
 
+        constexpr static bool off_slab_ = SlabDescPageProvider<Provider>;
+        constexpr static size_t header_bytes_ =
+            slab_header_bytes<Provider>;
         static_assert((obj_align_ & (obj_align_ - 1)) == 0,
                       "obj_align_ must be power-of-two");
 
+        using Geometry = SlabGeometry<obj_size_, obj_align_, header_bytes_>;
+        constexpr static size_t order_      = Geometry::order;
+        constexpr static size_t pages_      = Geometry::pages;
+        constexpr static size_t slab_bytes_ = Geometry::bytes;
+
     public:
         SlubAllocator();
+        ~SlubAllocator();
+        SlubAllocator(const SlubAllocator &)            = delete;
+        SlubAllocator &operator=(const SlubAllocator &) = delete;
         void *alloc();
         void free(void *ptr);
 
+        // How many partial slabs each cpu slot may keep before the whole
+        // batch goes to the node. 0 sends every partial slab to the node.
+        void set_cpu_partial(size_t slabs) {
+            cpu_partial_.store(slabs, std::memory_order_relaxed);
+        }
+        // How many empty slabs to keep for the next burst.
+        void set_min_partial(size_t slabs) {
+            min_partial_.store(slabs, std::memory_order_relaxed);
+        }
+        // Flush every cpu slot and give all empty slabs back to the page
+        // provider, min_partial notwithstanding. Returns the pages freed.
+        size_t shrink();
+
         SlubStats get_stats() const {
-            size_t total_slabs = partial.size() + full.size() + empty.size();
-            size_t objects_total = 0;
-            if (total_slabs > 0) {
-                // All slabs have same capacity
-                // We can get it from any slab, or calculate it.
-                // Since we don't have a slab instance, we calculate it.
-                auto base = (uintptr_t)0;
-                auto cur = align_up(base + sizeof(SlabHeader), obj_align_);
-                auto end = base + slab_bytes_;
-                size_t per_slab = 0;
-                while (cur + obj_size_ <= end) {
-                    per_slab++;
-                    cur += obj_size_;
+            constexpr size_t per_slab = Geometry::objects;
+            // Like slabinfo: frozen and partial slabs count by their
+            // counters, less what the slots hold, and full slabs count whole.
+            size_t inuse_objects = 0;
+            size_t frozen_slabs  = 0;
+            for (const CpuSlab &c : cpu_slabs_) {
+                std::lock_guard<SpinLock> slot(c.lock);
+                if (const SlabHeader *slab =
+                        c.slab.load(std::memory_order_relaxed))
+                {
+                    frozen_slabs++;
+                    inuse_objects +=
+                        slab_inuse(load_pair(&slab->objects).counters);
+                    inuse_objects -= slot_free(load_pair(&c.fast).counters);
+                }
+                for (const SlabHeader *slab = c.partial; slab;
+                     slab                   = slab->next)
+                {
+                    frozen_slabs++;
+                    inuse_objects +=
+                        slab_inuse(load_pair(&slab->objects).counters);
                 }
-                objects_total = total_slabs * per_slab;
+            }
+            std::lock_guard<std::mutex> guard(node_lock_);
+            for (const SlabHeader &slab : partial) {
+                inuse_objects += slab_inuse(load_pair(&slab.objects).counters);
+            }
+            size_t listed = partial.size() + empty.size() + frozen_slabs;
+            if (nr_slabs_ > listed) {
+                inuse_objects += (nr_slabs_ - listed) * per_slab;
             }
             return {
-                total_slabs,
-                inuse_objects_,
-                objects_total,
-                total_slabs * slab_bytes_
+                nr_slabs_,
+                inuse_objects,
+                nr_slabs_ * per_slab,
+                nr_slabs_ * slab_bytes_
             };
         }
 
     private:
+        // The fast path: a slot's own slab and freelist. alloc() pops and
+        // free() of an object of the slot's slab pushes with one
+        // cmpxchg_double on `fast`, taking no lock. `fast.counters` holds a
+        // transaction id in the high half and the length of the freelist in
+        // the low half.
+        //
+        // Everything else runs under `lock`, which serialises the slow paths
+        // of a slot. A slow path first swaps the freelist for SLOT_BUSY, so
+        // the lockless paths back off to it, and publishes a new pair when it
+        // is done; `slab` only changes in between.
+        //
+        // `partial` holds frozen slabs with free objects, which refills take
+        // before going to the node.
+        struct alignas(CACHE_LINE_SIZE) CpuSlab {
+            FreelistPair fast{};
+            mutable SpinLock lock;
+            std::atomic<SlabHeader *> slab{};
+            SlabHeader *partial{};
+            size_t nr_partial = 0;
+        };
+
+        static inline void *const SLOT_BUSY = reinterpret_cast<void *>(1);
+        static constexpr uint64_t TID_SHIFT = 32;
+        static constexpr uint64_t TID_ONE   = uint64_t{1} << TID_SHIFT;
+
+        // The counters after one more transaction that leaves `nr` objects
+        // on the slot's freelist.
+        static uint64_t next_counters(uint64_t counters, uint32_t nr) {
+            return (((counters >> TID_SHIFT) + 1) << TID_SHIFT) | nr;
+        }
+        static uint32_t slot_free(uint64_t counters) {
+            return static_cast<uint32_t>(counters);
+        }
+
+        CpuSlab cpu_slabs_[SLUB_CPU_SLOTS];
+        // The node: guards the lists and nr_slabs_. Taken after a slot lock,
+        // never before one.
+        mutable std::mutex node_lock_;
         util::IntrusiveList<SlabHeader> partial{};
-        util::IntrusiveList<SlabHeader> full{};
         util::IntrusiveList<SlabHeader> empty{};
-        size_t inuse_objects_ = 0;
+        // Every slab, frozen and full ones included.
+        size_t nr_slabs_ = 0;
+        std::atomic<size_t> cpu_partial_{SLUB_CPU_PARTIAL_SLABS};
+        std::atomic<size_t> min_partial_{SLUB_MIN_PARTIAL};
+        // Colour of the next new slab; see SlabGeometry.
+        std::atomic<size_t> colour_next_{0};
+        BuddyShrinker shrinker_{};
+        SlabCache cache_{};
 
-        SlabHeader *new_slab();
-        void init_slab_headers(SlabHeader *slab);
+        static void kfree_object(void *self, void *ptr) {
+            static_cast<SlubAllocator *>(self)->free(ptr);
+        }
+
+        // Shrinker callback: flush the cpu slots it can lock and hand empty
+        // slabs back to the provider.
+        static size_t shrink_empty(void *self, size_t nr_pages);
+        size_t discard_empty(size_t nr_pages);
+        void discard_slab(SlabHeader *slab);
+
+        CpuSlab &this_cpu() {
+            return cpu_slabs_[this_cpu_slot()];
+        }
+        FreelistPair begin_slow(CpuSlab &c);
+        void end_slow(CpuSlab &c, void *freelist, uint32_t nr);
+        void *alloc_slow(CpuSlab &c);
+        void free_slow(CpuSlab &c, SlabHeader *slab, void *ptr);
+        void *take_objects(SlabHeader *slab, uint32_t &nr);
+        void *get_partial_node(CpuSlab &c, uint32_t &nr);
+        void put_cpu_partial(CpuSlab &c, SlabHeader *slab);
+        void freeze(SlabHeader *slab);
+        bool unfreeze_full(SlabHeader *slab);
+        void unfreeze(SlabHeader *slab, void *freelist);
+        void flush_cpu_slab(CpuSlab &c);
+
+        size_t new_slabs();
+        SlabHeader *init_slab(void *mem);
         SlabHeader *slab_of(void *p);
 
         void to_empty(SlabHeader *slab);
         void to_partial(SlabHeader *slab);
-        void to_full(SlabHeader *slab);
 
         void inner_free(void *ptr);
     };
 
-    template <HugeObjectType ObjType>
-    class SlubAllocator<ObjType> {
+    // Page runs in the arenas are marked in their head page's descriptor,
+    // so kfree() finds them too; directly mapped ones have none.
+    template <typename ObjType, PageProvider Provider>
+        requires HugeObjectType<ObjType, Provider>
+    class SlubAllocator<ObjType, Provider> {
     public:
         SlubAllocator() : inuse_objects_(0) {
+            cache_.free        = kfree_object;
+            cache_.ctx         = this;
+            cache_.object_size = sizeof(ObjType);
         }
         void *alloc() {
-            void* p = Buddy::alloc_pages(
-                (sizeof(ObjType) + PAGE_SIZE - 1) / PAGE_SIZE);
-            if (p) inuse_objects_++;
+            void* p = Provider::alloc_pages(
+                (sizeof(ObjType) + PAGE_SIZE - 1) / PAGE_SIZE, GFP_RECLAIMABLE);
+            if (p) inuse_objects_.fetch_add(1, std::memory_order_relaxed);
+            if constexpr (SlabDescPageProvider<Provider>) {
+                if (SlabHeader *desc = p ? Provider::virt_to_slab(p)
+                                         : nullptr)
+                {
+                    desc->head  = desc;
+                    desc->cache = &cache_;
+                }
+            }
             return p;
         }
         void free(void *ptr) {
@@ -165,151 +821,487 @@ namespace slub {
                 printf("can't free nullptr\n");
                 return;
             }
-            Buddy::free_pages(
+            if constexpr (SlabDescPageProvider<Provider>) {
+                if (SlabHeader *desc = Provider::virt_to_slab(ptr)) {
+                    desc->cache = nullptr;
+                }
+            }
+            Provider::free_pages(
                 ptr, (sizeof(ObjType) + PAGE_SIZE - 1) / PAGE_SIZE);
-            inuse_objects_--;
+            inuse_objects_.fetch_sub(1, std::memory_order_relaxed);
         }
         SlubStats get_stats() const {
             size_t pages_per_obj = (sizeof(ObjType) + PAGE_SIZE - 1) / PAGE_SIZE;
+            size_t inuse = inuse_objects_.load(std::memory_order_relaxed);
             return {
-                inuse_objects_, // Each huge object is effectively its own slab
-                inuse_objects_,
-                inuse_objects_,
-                inuse_objects_ * pages_per_obj * PAGE_SIZE
+                inuse, // Each huge object is effectively its own slab
+                inuse,
+                inuse,
+                inuse * pages_per_obj * PAGE_SIZE
             };
         }
     private:
-        size_t inuse_objects_;
+        std::atomic<size_t> inuse_objects_;
+        SlabCache cache_{};
+
+        static void kfree_object(void *self, void *ptr) {
+            static_cast<SlubAllocator *>(self)->free(ptr);
+        }
     };
 
-    template <typename ObjType>
-    SlabHeader *SlubAllocator<ObjType>::slab_of(void *p) {
+    // The slab's first page, found by masking, then its descriptor: off-slab
+    // in the provider's table, or else at the start of the slab.
+    template <typename ObjType, PageProvider Provider>
+    SlabHeader *SlubAllocator<ObjType, Provider>::slab_of(void *p) {
         auto ptr  = reinterpret_cast<uintptr_t>(p);
-        auto base = align_down(ptr, slab_bytes_);
-        return reinterpret_cast<SlabHeader *>(base);
+        auto base = reinterpret_cast<void *>(align_down(ptr, slab_bytes_));
+        if constexpr (off_slab_) {
+            return Provider::virt_to_slab(base);
+        } else {
+            return static_cast<SlabHeader *>(base);
+        }
     }
 
-    template <typename ObjType>
-    void SlubAllocator<ObjType>::init_slab_headers(SlabHeader *slab) {
-        auto base = reinterpret_cast<uintptr_t>(slab);
-        auto cur  = base + sizeof(SlabHeader);
-        cur       = align_up(cur, obj_align_);
-        auto end  = base + slab_bytes_;
-
-        size_t total = 0;
-        auto p       = cur;
-        while (p + obj_size_ <= end) {
-            total++;
-            p += obj_size_;
+    // Set up the descriptor of fresh slab pages `mem` and thread its
+    // objects onto its freelist.
+    template <typename ObjType, PageProvider Provider>
+    SlabHeader *SlubAllocator<ObjType, Provider>::init_slab(void *mem) {
+        SlabHeader *slab;
+        if constexpr (off_slab_) {
+            slab = new (Provider::virt_to_slab(mem)) SlabHeader{};
+            for (size_t i = 0; i < pages_; i++) {
+                Provider::virt_to_slab(static_cast<std::byte *>(mem) +
+                                       i * PAGE_SIZE)
+                    ->head = slab;
+            }
+            slab->cache = &cache_;
+        } else {
+            slab = new (mem) SlabHeader{};
         }
+        slab->base  = mem;
+        slab->total = Geometry::objects;
 
-        slab->total = total;
-        slab->inuse = 0;
-
+        size_t colour = 0;
+        if constexpr (Geometry::colours > 1) {
+            colour = colour_next_.fetch_add(1, std::memory_order_relaxed) %
+                     Geometry::colours;
+        }
+        auto cur = reinterpret_cast<uintptr_t>(mem) + Geometry::first_offset +
+                   colour * Geometry::colour_off;
         void *head = nullptr;
 
-        // construct from end to start
-        for (size_t i = total; i > 0; i--) {
+        // construct from end to start. The pages may have been another
+        // slab's, whose slot can still be reading a stale free link in
+        // alloc(), so the links are stored atomically.
+        for (size_t i = Geometry::objects; i > 0; i--) {
             void *obj = reinterpret_cast<void *>(cur + (i - 1) * obj_size_);
-            *reinterpret_cast<void **>(obj) = head;
-            head                            = obj;
+            __atomic_store_n(reinterpret_cast<void **>(obj), head,
+                             __ATOMIC_RELAXED);
+            head = obj;
         }
-        slab->freelist = head;
+        slab->objects = {head, 0};
+        return slab;
     }
 
-    template <typename ObjType>
-    SlabHeader *SlubAllocator<ObjType>::new_slab() {
-        void *mem        = Buddy::alloc_pages(pages_);
-        SlabHeader *slab = new (mem) SlabHeader{};
-        init_slab_headers(slab);
-        return slab;
+    // Add up to SLAB_REFILL_BATCH fresh slabs to the empty list. Returns how
+    // many were added.
+    template <typename ObjType, PageProvider Provider>
+    size_t SlubAllocator<ObjType, Provider>::new_slabs() {
+        void *mem[SLAB_REFILL_BATCH];
+        size_t got = 0;
+        if constexpr (BulkPageProvider<Provider>) {
+            got = Provider::alloc_pages_bulk(pages_, SLAB_REFILL_BATCH, mem);
+        } else {
+            mem[0] = Provider::alloc_pages(pages_, 0);
+            got    = mem[0] ? 1 : 0;
+        }
+        SlabHeader *slabs[SLAB_REFILL_BATCH];
+        for (size_t i = 0; i < got; i++) {
+            slabs[i] = init_slab(mem[i]);
+        }
+        std::lock_guard<std::mutex> guard(node_lock_);
+        for (size_t i = 0; i < got; i++) {
+            empty.push_back(*slabs[i]);
+        }
+        nr_slabs_ += got;
+        return got;
     }
 
-    template <typename ObjType>
-    void SlubAllocator<ObjType>::to_empty(SlabHeader *slab) {
+    // Slabs coming from no list (frozen or full) are only pushed. Past
+    // min_partial the slab goes back to the provider instead.
+    template <typename ObjType, PageProvider Provider>
+    void SlubAllocator<ObjType, Provider>::to_empty(SlabHeader *slab) {
         if (slab->state == SlabHeader::SlabState::PARTIAL) {
             partial.erase(typename decltype(partial)::iterator(slab));
-        } else if (slab->state == SlabHeader::SlabState::FULL) {
-            full.erase(typename decltype(full)::iterator(slab));
+        }
+        if (empty.size() >= min_partial_.load(std::memory_order_relaxed)) {
+            discard_slab(slab);
+            return;
         }
         slab->state = SlabHeader::SlabState::EMPTY;
         empty.push_back(*slab);
     }
 
-    template <typename ObjType>
-    void SlubAllocator<ObjType>::to_partial(SlabHeader *slab) {
+    // Freeing pages never runs shrinkers, so this is safe under node_lock_,
+    // which the caller holds.
+    template <typename ObjType, PageProvider Provider>
+    void SlubAllocator<ObjType, Provider>::discard_slab(SlabHeader *slab) {
+        nr_slabs_--;
+        slab->cache = nullptr;
+        Provider::free_pages(slab->base, pages_);
+    }
+
+    // Free up to `nr_pages` pages' worth of empty slabs. Caller holds
+    // node_lock_.
+    template <typename ObjType, PageProvider Provider>
+    size_t SlubAllocator<ObjType, Provider>::discard_empty(size_t nr_pages) {
+        size_t freed = 0;
+        while (freed < nr_pages && !empty.empty()) {
+            SlabHeader *slab = &empty.back();
+            empty.pop_back();
+            discard_slab(slab);
+            freed += pages_;
+        }
+        return freed;
+    }
+
+    template <typename ObjType, PageProvider Provider>
+    void SlubAllocator<ObjType, Provider>::to_partial(SlabHeader *slab) {
         if (slab->state == SlabHeader::SlabState::EMPTY) {
             empty.erase(typename decltype(empty)::iterator(slab));
-        } else if (slab->state == SlabHeader::SlabState::FULL) {
-            full.erase(typename decltype(full)::iterator(slab));
         }
         slab->state = SlabHeader::SlabState::PARTIAL;
         partial.push_back(*slab);
     }
 
-    // to_full remains mostly same but for consistency safety
-    template <typename ObjType>
-    void SlubAllocator<ObjType>::to_full(SlabHeader *slab) {
+    // Take a node slab off its list for a cpu slot, keeping its objects in
+    // `objects`. Caller holds node_lock_.
+    template <typename ObjType, PageProvider Provider>
+    void SlubAllocator<ObjType, Provider>::freeze(SlabHeader *slab) {
         if (slab->state == SlabHeader::SlabState::PARTIAL) {
             partial.erase(typename decltype(partial)::iterator(slab));
-        } else if (slab->state == SlabHeader::SlabState::EMPTY) {
-            // Should not happen for to_full usually
+        } else {
             empty.erase(typename decltype(empty)::iterator(slab));
         }
+        slab->state      = SlabHeader::SlabState::FROZEN;
+        FreelistPair cur = load_pair(&slab->objects);
+        while (!cmpxchg_double(&slab->objects, cur,
+                               {cur.freelist, cur.counters | SLAB_FROZEN}))
+        {
+        }
+    }
+
+    // Take all free objects, `nr` of them, of a slab the slot owns, leaving
+    // it frozen. Needs no node_lock_: a frozen slab is on no list.
+    template <typename ObjType, PageProvider Provider>
+    void *SlubAllocator<ObjType, Provider>::take_objects(SlabHeader *slab,
+                                                         uint32_t &nr) {
+        FreelistPair cur = load_pair(&slab->objects);
+        while (cur.freelist &&
+               !cmpxchg_double(&slab->objects, cur,
+                               {nullptr, slab->total | SLAB_FROZEN}))
+        {
+        }
+        nr = slab->total - slab_inuse(cur.counters);
+        return cur.freelist;
+    }
+
+    // Let go of a frozen slab that has no free objects, without node_lock_:
+    // a full slab is on no list. Fails if objects came back meanwhile.
+    template <typename ObjType, PageProvider Provider>
+    bool SlubAllocator<ObjType, Provider>::unfreeze_full(SlabHeader *slab) {
+        FreelistPair cur = load_pair(&slab->objects);
+        if (cur.freelist) {
+            return false;
+        }
+        // Set first: once unfrozen, the slab is someone else's to freeze.
         slab->state = SlabHeader::SlabState::FULL;
-        full.push_back(*slab);
+        if (cmpxchg_double(&slab->objects, cur,
+                           {nullptr, cur.counters & ~SLAB_FROZEN}))
+        {
+            return true;
+        }
+        slab->state = SlabHeader::SlabState::FROZEN;
+        return false;
     }
 
-    template <typename ObjType>
-    void *SlubAllocator<ObjType>::alloc() {
-        SlabHeader *slab = nullptr;
-        if (!partial.empty()) {
-            slab = &partial.back();
-            assert(slab != nullptr);
-        } else if (!empty.empty()) {
-            slab = &empty.back();
-            assert(slab != nullptr);
+    // Give a frozen slab back to the node, with `freelist`, what its slot
+    // still held of it. Caller holds node_lock_, which keeps frees that
+    // would move the slab between lists waiting until it is on one.
+    template <typename ObjType, PageProvider Provider>
+    void SlubAllocator<ObjType, Provider>::unfreeze(SlabHeader *slab,
+                                                    void *freelist) {
+        void *tail  = freelist;
+        uint32_t nr = 0;
+        for (void *obj = freelist; obj; obj = *reinterpret_cast<void **>(obj)) {
+            tail = obj;
+            nr++;
+        }
+        // The list insert skips linked nodes, and `next` may still link a
+        // slot's partial list.
+        slab->next = nullptr;
+        // Set first, as in unfreeze_full(): a full slab is on no list.
+        slab->state      = SlabHeader::SlabState::FULL;
+        FreelistPair cur = load_pair(&slab->objects);
+        FreelistPair next;
+        do {
+            next.freelist = cur.freelist;
+            if (tail) {
+                // Atomic, as in free_slow(): a slot's alloc() may still be
+                // reading this link speculatively.
+                __atomic_store_n(reinterpret_cast<void **>(tail),
+                                 cur.freelist, __ATOMIC_RELAXED);
+                next.freelist = freelist;
+            }
+            next.counters = slab_inuse(cur.counters) - nr;
+        } while (!cmpxchg_double(&slab->objects, cur, next));
+        if (slab_inuse(next.counters) == 0) {
+            to_empty(slab);
+        } else if (next.freelist) {
             to_partial(slab);
-        } else {
-            slab = new_slab();
-            assert(slab);
-            slab->state = SlabHeader::SlabState::PARTIAL;
-            partial.push_back(*slab);
         }
+    }
 
-        assert(slab != nullptr);
-        assert(slab->freelist != nullptr);
-        void *obj      = slab->freelist;
-        slab->freelist = *reinterpret_cast<void **>(obj);
-        slab->inuse++;
-        inuse_objects_++;
+    // Freeze a partial slab of the node, or else an empty one, for the slot
+    // and return its objects, `nr` of them. While the lock is held, also
+    // move up to half of the cpu partial budget to the slot's partial list.
+    // Caller holds the slot lock.
+    template <typename ObjType, PageProvider Provider>
+    void *SlubAllocator<ObjType, Provider>::get_partial_node(CpuSlab &c,
+                                                             uint32_t &nr) {
+        std::lock_guard<std::mutex> guard(node_lock_);
+        SlabHeader *slab = !partial.empty() ? &partial.back()
+                           : !empty.empty() ? &empty.back()
+                                            : nullptr;
+        if (!slab) {
+            return nullptr;
+        }
+        freeze(slab);
+        c.slab.store(slab, std::memory_order_relaxed);
+        const size_t budget = cpu_partial_.load(std::memory_order_relaxed) / 2;
+        while (c.nr_partial < budget && !partial.empty()) {
+            SlabHeader *extra = &partial.back();
+            freeze(extra);
+            extra->next = c.partial;
+            c.partial   = extra;
+            c.nr_partial++;
+        }
+        return take_objects(slab, nr);
+    }
 
-        if (slab->inuse == slab->total) {
-            to_full(slab);
+    // `slab` was full and this slot's free just froze it: keep it on the
+    // slot's partial list, and send the whole list to the node once it
+    // outgrows the budget.
+    template <typename ObjType, PageProvider Provider>
+    void SlubAllocator<ObjType, Provider>::put_cpu_partial(CpuSlab &c,
+                                                           SlabHeader *slab) {
+        SlabHeader *flush = nullptr;
+        {
+            std::lock_guard<SpinLock> slot(c.lock);
+            slab->state  = SlabHeader::SlabState::FROZEN;
+            slab->next   = c.partial;
+            c.partial    = slab;
+            if (++c.nr_partial > cpu_partial_.load(std::memory_order_relaxed)) {
+                flush        = c.partial;
+                c.partial    = nullptr;
+                c.nr_partial = 0;
+            }
+        }
+        if (!flush) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(node_lock_);
+        while (flush) {
+            SlabHeader *next = flush->next;
+            unfreeze(flush, nullptr);
+            flush = next;
+        }
+    }
+
+    // Give everything the slot holds back to the node. Caller holds the slot
+    // lock.
+    template <typename ObjType, PageProvider Provider>
+    void SlubAllocator<ObjType, Provider>::flush_cpu_slab(CpuSlab &c) {
+        FreelistPair cur = begin_slow(c);
+        {
+            std::lock_guard<std::mutex> guard(node_lock_);
+            if (SlabHeader *slab = c.slab.load(std::memory_order_relaxed)) {
+                unfreeze(slab, cur.freelist);
+                c.slab.store(nullptr, std::memory_order_relaxed);
+            }
+            while (SlabHeader *slab = c.partial) {
+                c.partial = slab->next;
+                unfreeze(slab, nullptr);
+            }
+            c.nr_partial = 0;
         }
+        end_slow(c, nullptr, 0);
+    }
+
+    // Take the slot's freelist for a slow path, leaving SLOT_BUSY so the
+    // lockless paths stay off the slot. Caller holds the slot lock.
+    template <typename ObjType, PageProvider Provider>
+    FreelistPair SlubAllocator<ObjType, Provider>::begin_slow(CpuSlab &c) {
+        FreelistPair cur = load_pair(&c.fast);
+        while (!cmpxchg_double(&c.fast, cur,
+                               {SLOT_BUSY, next_counters(cur.counters, 0)}))
+        {
+        }
+        return cur;
+    }
+
+    // Hand the slot back to the lockless paths with `freelist`, `nr` objects
+    // long.
+    template <typename ObjType, PageProvider Provider>
+    void SlubAllocator<ObjType, Provider>::end_slow(CpuSlab &c, void *freelist,
+                                                    uint32_t nr) {
+        FreelistPair busy = load_pair(&c.fast);
+        // Nobody else swaps a busy pair, so this cannot fail.
+        cmpxchg_double(&c.fast, busy,
+                       {freelist, next_counters(busy.counters, nr)});
+    }
+
+    // The slot's freelist is empty: pick up objects other slots freed to its
+    // slab, or switch to a slab from the slot's partial list, the node's
+    // lists, or the provider. Returns an object.
+    template <typename ObjType, PageProvider Provider>
+    void *SlubAllocator<ObjType, Provider>::alloc_slow(CpuSlab &c) {
+        std::unique_lock<SpinLock> slot(c.lock);
+        FreelistPair cur = begin_slow(c);
+        // Another thread of this slot may have refilled it meanwhile.
+        void *freelist = cur.freelist;
+        uint32_t nr    = slot_free(cur.counters);
+        while (!freelist) {
+            if (SlabHeader *slab = c.slab.load(std::memory_order_relaxed)) {
+                if ((freelist = take_objects(slab, nr)) ||
+                    !unfreeze_full(slab))
+                {
+                    continue;
+                }
+                c.slab.store(nullptr, std::memory_order_relaxed);
+            }
+            if (SlabHeader *slab = c.partial) {
+                c.partial = slab->next;
+                c.nr_partial--;
+                c.slab.store(slab, std::memory_order_relaxed);
+                continue;
+            }
+            if ((freelist = get_partial_node(c, nr))) {
+                break;
+            }
+            // Under neither node_lock_ nor the slot lock: the provider may
+            // take its own locks, run shrinkers, ours included, and make
+            // syscalls. The slot, with no slab now, goes back to the
+            // lockless paths empty meanwhile, so they fall through to here.
+            end_slow(c, nullptr, 0);
+            slot.unlock();
+            const bool grown = new_slabs() > 0;
+            slot.lock();
+            cur      = begin_slow(c);
+            freelist = cur.freelist;
+            nr       = slot_free(cur.counters);
+            if (!grown && !freelist) {
+                end_slow(c, nullptr, 0);
+                return nullptr;
+            }
+        }
+        void *obj = freelist;
+        end_slow(c, *reinterpret_cast<void **>(obj), nr - 1);
         return obj;
     }
 
-    template <typename ObjType>
-    void SlubAllocator<ObjType>::inner_free(void *ptr) {
+    template <typename ObjType, PageProvider Provider>
+    void *SlubAllocator<ObjType, Provider>::alloc() {
+        CpuSlab &c       = this_cpu();
+        FreelistPair cur = load_pair(&c.fast);
+        for (;;) {
+            void *obj = cur.freelist;
+            if (!obj || obj == SLOT_BUSY) [[unlikely]] {
+                return alloc_slow(c);
+            }
+            // obj may be taken and reused by another thread of this slot,
+            // even its slab discarded, before the swap; the swap then fails
+            // and `next` is not used. The provider keeps the page readable
+            // (see PageProvider).
+            void *next = __atomic_load_n(reinterpret_cast<void **>(obj),
+                                         __ATOMIC_RELAXED);
+            if (cmpxchg_double(&c.fast, cur,
+                               {next, cur.counters - 1 + TID_ONE}))
+                [[likely]]
+            {
+                return obj;
+            }
+        }
+    }
+
+    // An object of a slab that is not this slot's: push it to the slab's own
+    // freelist. A full slab is frozen onto this slot's partial list, and
+    // node_lock_ is only taken when a partial slab of the node becomes
+    // empty, so frees to another thread's slabs, the producer/consumer
+    // case, rarely wait for their owner or the node.
+    template <typename ObjType, PageProvider Provider>
+    void SlubAllocator<ObjType, Provider>::free_slow(CpuSlab &c,
+                                                     SlabHeader *slab,
+                                                     void *ptr) {
+        std::unique_lock<std::mutex> node(node_lock_, std::defer_lock);
+        FreelistPair cur = load_pair(&slab->objects);
+        bool take, emptied;
+        for (;;) {
+            // With the lock held, a slab of the node cannot be frozen or
+            // unfrozen under us.
+            bool frozen = cur.counters & SLAB_FROZEN;
+            take        = !frozen && !cur.freelist;
+            emptied     = !frozen && !take && slab_inuse(cur.counters) == 1;
+            if (emptied && !node.owns_lock()) {
+                node.lock();
+                cur = load_pair(&slab->objects);
+                continue;
+            }
+            __atomic_store_n(reinterpret_cast<void **>(ptr), cur.freelist,
+                             __ATOMIC_RELAXED);
+            uint64_t counters = (cur.counters - 1) | (take ? SLAB_FROZEN : 0);
+            if (cmpxchg_double(&slab->objects, cur, {ptr, counters})) {
+                break;
+            }
+        }
+        if (emptied) {
+            to_empty(slab);
+        } else if (take) {
+            if (node.owns_lock()) {
+                node.unlock();
+            }
+            put_cpu_partial(c, slab);
+        }
+    }
+
+    template <typename ObjType, PageProvider Provider>
+    void SlubAllocator<ObjType, Provider>::inner_free(void *ptr) {
         if (!ptr) {
             printf("can't free null pointer\n");
             return;
         }
-        SlabHeader *slab_header         = slab_of(ptr);
-        *reinterpret_cast<void **>(ptr) = slab_header->freelist;
-        slab_header->freelist           = ptr;
-        slab_header->inuse--;
-        inuse_objects_--;
-        if (slab_header->inuse == 0) {
-            to_empty(slab_header);
-        } else if (slab_header->inuse == slab_header->total - 1) {
-            to_partial(slab_header);
+        SlabHeader *slab = slab_of(ptr);
+        CpuSlab &c       = this_cpu();
+        FreelistPair cur = load_pair(&c.fast);
+        // `slab` is read after the pair and only changes while the pair is
+        // busy, so a successful swap means it was the slot's slab throughout.
+        while (cur.freelist != SLOT_BUSY &&
+               slab == c.slab.load(std::memory_order_relaxed))
+        {
+            __atomic_store_n(reinterpret_cast<void **>(ptr), cur.freelist,
+                             __ATOMIC_RELAXED);
+            if (cmpxchg_double(&c.fast, cur,
+                               {ptr, cur.counters + 1 + TID_ONE}))
+                [[likely]]
+            {
+                return;
+            }
         }
+        free_slow(c, slab, ptr);
     }
 
-    template <typename ObjType>
-    void SlubAllocator<ObjType>::free(void *ptr) {
+    template <typename ObjType, PageProvider Provider>
+    void SlubAllocator<ObjType, Provider>::free(void *ptr) {
         if (!ptr) {
             printf("can't free nullptr\n");
             return;
@@ -318,6 +1310,64 @@ namespace slub {
         inner_free(ptr);
     }
 
-    template <typename ObjType>
-    SlubAllocator<ObjType>::SlubAllocator() {}
+    // May run on a thread that holds one of our slot locks (its refill
+    // asked the provider for pages), so busy slots are skipped.
+    template <typename ObjType, PageProvider Provider>
+    size_t SlubAllocator<ObjType, Provider>::shrink_empty(void *self,
+                                                          size_t nr_pages) {
+        auto *allocator = static_cast<SlubAllocator *>(self);
+        for (CpuSlab &c : allocator->cpu_slabs_) {
+            std::unique_lock<SpinLock> slot(c.lock, std::try_to_lock);
+            if (slot.owns_lock()) {
+                allocator->flush_cpu_slab(c);
+            }
+        }
+        std::lock_guard<std::mutex> guard(allocator->node_lock_);
+        return allocator->discard_empty(nr_pages);
+    }
+
+    // Flushing already discards the slabs that drain past min_partial, so
+    // count what went, not what discard_empty() found.
+    template <typename ObjType, PageProvider Provider>
+    size_t SlubAllocator<ObjType, Provider>::shrink() {
+        size_t before = 0;
+        {
+            std::lock_guard<std::mutex> guard(node_lock_);
+            before = nr_slabs_;
+        }
+        for (CpuSlab &c : cpu_slabs_) {
+            std::lock_guard<SpinLock> slot(c.lock);
+            flush_cpu_slab(c);
+        }
+        std::lock_guard<std::mutex> guard(node_lock_);
+        discard_empty(SIZE_MAX);
+        return before > nr_slabs_ ? (before - nr_slabs_) * pages_ : 0;
+    }
+
+    template <typename ObjType, PageProvider Provider>
+    SlubAllocator<ObjType, Provider>::SlubAllocator() {
+        cache_.free        = kfree_object;
+        cache_.ctx         = this;
+        cache_.object_size = obj_size_;
+        if constexpr (ShrinkablePageProvider<Provider>) {
+            shrinker_.shrink = shrink_empty;
+            shrinker_.ctx    = this;
+            Provider::register_shrinker(shrinker_);
+        }
+    }
+
+    // Every slab goes back to the provider, unless objects are still in
+    // use: their slabs stay mapped, and are reported.
+    template <typename ObjType, PageProvider Provider>
+    SlubAllocator<ObjType, Provider>::~SlubAllocator() {
+        if constexpr (ShrinkablePageProvider<Provider>) {
+            Provider::unregister_shrinker(shrinker_);
+        }
+        shrink();
+        if (nr_slabs_ > 0) {
+            printf("slub: cache destroyed with objects in use, %zu slabs "
+                   "left\n",
+                   nr_slabs_);
+        }
+    }
 }  // namespace slub
@@ -1,80 +1,1511 @@
 #include "slub.h"
 
+#include <sys/mman.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <condition_variable>
 #include <cstring>
+#include <mutex>
 #include <random>
+#include <thread>
 #include <chrono>
 
+// Time every page operation for the benchmark. Compiled out by default; the
+// counters below are always kept.
+#ifndef SLUB_BUDDY_TIMING
+#define SLUB_BUDDY_TIMING 0
+#endif
 
 namespace slub {
-    static size_t g_total_pages   = 0;
-    static size_t g_current_pages = 0;
-    static double g_buddy_alloc_time_ms = 0;
-    static double g_buddy_free_time_ms = 0;
-    static size_t g_buddy_alloc_count = 0;
-    static size_t g_buddy_free_count = 0;
-
-    void *Buddy::alloc_pages(size_t pages) {
-        auto start = std::chrono::high_resolution_clock::now();
-        const size_t bytes = pages * PAGE_SIZE;
-        void *ptr          = std::aligned_alloc(PAGE_SIZE, bytes);
+    // Per-page descriptor kept outside the arena, so free blocks are never
+    // touched by the allocator itself. Only the head page of a block is used.
+    // `flags` and `order` are only written under the owning arena's lock;
+    // once a block leaves the free lists its state moves to `owner_state`,
+    // which only the current holder of the block touches.
+    struct Page {
+        enum Flags : uint32_t {
+            PG_BUDDY    = 1u << 0,  // head of a free block on a free list
+            PG_ZEROED   = 1u << 1,  // block content is known to be all zero
+            PG_RELEASED = 1u << 2,  // block was given back with madvise()
+        };
+        // State a free block carries through splits, merges and the
+        // per-thread cache.
+        static constexpr uint32_t STATE_MASK = PG_ZEROED | PG_RELEASED;
+        Page *prev{};
+        Page *next{};
+        uint32_t flags{};
+        uint32_t order{};
+        uint32_t owner_state{};
+        uint32_t owner_migratetype{};  // class the holder asked for
+    };
+
+    static_assert(util::IntrusiveListNodeTrait<Page>,
+                  "Page fails to be a valid intrusive list node");
+
+    // A free block sits on the list of its head pageblock's migrate type.
+    struct FreeArea {
+        util::IntrusiveList<Page> lists[MIGRATE_TYPES]{};
+        size_t nr_free = 0;
+    };
+
+    // One independently locked slice of the reservation. Blocks never merge
+    // across arenas because every arena spans whole max-order blocks.
+    struct Arena {
+        std::mutex lock;
+        FreeArea free_area[BUDDY_MAX_ORDER + 1];
+        size_t nr_pageblocks[MIGRATE_TYPES]{};
+        BuddyReleasePolicy release{};
+        // Pages on the free lists that may still be backed by RAM.
+        size_t free_resident_pages = 0;
+    };
+
+    constexpr size_t PAGEBLOCK_PAGES = size_t{1} << BUDDY_PAGEBLOCK_ORDER;
+
+    static std::uintptr_t g_arena_base = 0;
+    static size_t g_arena_pages        = 0;
+    static Page *g_page_map            = nullptr;
+    // Migrate type of every pageblock, written under the arena lock.
+    static uint8_t *g_pageblock_mt     = nullptr;
+    static Arena g_arenas[BUDDY_MAX_ARENAS];
+    static size_t g_nr_arenas  = 0;
+    static size_t g_arena_span = 0;  // pages per arena
+    static std::atomic<bool> g_ready{false};
+    // After the implicit init() fails, it is retried no sooner than this
+    // steady-clock time (ns), so a burst of calls under memory pressure does
+    // not map and unmap once each.
+    static std::atomic<int64_t> g_init_retry_ns{0};
+    constexpr int64_t INIT_RETRY_INTERVAL_NS = 10'000'000;
+    static std::atomic<size_t> g_next_arena{0};
+    static std::mutex g_init_lock;
+    static BuddyReleasePolicy g_release_policy{};
+    static HugePageMode g_huge_mode = HugePageMode::NONE;
+    // Set when the arenas live in a caller's region: nothing is mapped,
+    // released or unmapped after init().
+    static bool g_static_region  = false;
+    static void *g_region        = nullptr;
+    static size_t g_region_bytes = 0;
+    static bool g_locked         = false;
+    // What init() was given, to refuse a different config later.
+    static BuddyConfig g_config{};
+
+    // Pages charged against the budget: everything taken off the free lists,
+    // per-thread caches included, plus direct mappings. Updated once per lock
+    // round trip, not per page.
+    static std::atomic<size_t> g_used_pages{0};
+    static std::atomic<size_t> g_budget_limit{0};
+    static std::atomic<size_t> g_budget_high{0};
+    static std::atomic<size_t> g_budget_low{0};
+    static std::mutex g_shrinker_lock;
+    static util::IntrusiveList<BuddyShrinker> g_shrinkers;
+    static thread_local bool t_in_reclaim = false;
+
+    // Pages parked in a per-thread cache are still allocated as far as the
+    // free lists are concerned; they are neither PG_BUDDY nor mergeable.
+    struct PerCpuPages {
+        util::IntrusiveList<Page> lists[MIGRATE_TYPES][BUDDY_PCP_MAX_ORDER + 1];
+        void drain();
+        ~PerCpuPages() {
+            drain();
+        }
+    };
+
+    static thread_local PerCpuPages t_pcp;
+    // Threads are spread over the arenas round-robin.
+    static thread_local size_t t_arena_id = g_next_arena.fetch_add(1);
+
+    enum BuddyStat {
+        STAT_ALLOC_PAGES,
+        STAT_FREE_PAGES,
+        STAT_ALLOC_COUNT,
+        STAT_FREE_COUNT,
+        STAT_ALLOC_NS,
+        STAT_FREE_NS,
+        NR_BUDDY_STATS
+    };
+
+    // Per-thread statistics, summed on read. Only the owning thread writes
+    // its counters, so an update is a relaxed load and store with no locked
+    // instruction and no shared cache line. A thread folds its counters into
+    // g_stats_retired when it exits.
+    struct BuddyCounters {
+        BuddyCounters *prev{};
+        BuddyCounters *next{};
+        std::atomic<uint64_t> stat[NR_BUDDY_STATS]{};
+        BuddyCounters();
+        ~BuddyCounters();
+    };
+
+    static std::mutex g_stats_lock;
+    static util::IntrusiveList<BuddyCounters> g_stats_threads;
+    static uint64_t g_stats_retired[NR_BUDDY_STATS]{};
+    // Subtracted on read, so reset_timers() never writes another thread's
+    // counters.
+    static uint64_t g_stats_base[NR_BUDDY_STATS]{};
+    static thread_local BuddyCounters t_stats;
+
+    BuddyCounters::BuddyCounters() {
+        std::lock_guard<std::mutex> guard(g_stats_lock);
+        g_stats_threads.push_back(*this);
+    }
+
+    BuddyCounters::~BuddyCounters() {
+        std::lock_guard<std::mutex> guard(g_stats_lock);
+        for (size_t i = 0; i < NR_BUDDY_STATS; i++) {
+            g_stats_retired[i] += stat[i].load(std::memory_order_relaxed);
+        }
+        g_stats_threads.erase(
+            typename decltype(g_stats_threads)::iterator(this));
+    }
+
+    static inline void stat_add(BuddyStat item, uint64_t delta) {
+        auto &counter = t_stats.stat[item];
+        counter.store(counter.load(std::memory_order_relaxed) + delta,
+                      std::memory_order_relaxed);
+    }
+
+    // Caller holds g_stats_lock.
+    static uint64_t stat_total(BuddyStat item) {
+        uint64_t sum = g_stats_retired[item];
+        for (const BuddyCounters &counters : g_stats_threads) {
+            sum += counters.stat[item].load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    static uint64_t stat_sum(BuddyStat item) {
+        std::lock_guard<std::mutex> guard(g_stats_lock);
+        return stat_total(item) - g_stats_base[item];
+    }
+
+#if SLUB_BUDDY_TIMING
+    static std::atomic<bool> g_timing{true};
+
+    static inline uint64_t timing_start() {
+        if (!g_timing.load(std::memory_order_relaxed)) {
+            return 0;
+        }
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    static inline void timing_end(BuddyStat item, uint64_t start) {
+        if (start) {
+            stat_add(item, timing_start() - start);
+        }
+    }
+#else
+    static inline uint64_t timing_start() {
+        return 0;
+    }
+
+    static inline void timing_end(BuddyStat, uint64_t) {}
+#endif
+
+    static inline size_t page_to_pfn(const Page *page) {
+        return static_cast<size_t>(page - g_page_map);
+    }
+
+    static inline void *pfn_to_virt(size_t pfn) {
+        return reinterpret_cast<void *>(g_arena_base + pfn * PAGE_SIZE);
+    }
+
+    static inline size_t virt_to_pfn(const void *p) {
+        return (reinterpret_cast<std::uintptr_t>(p) - g_arena_base) / PAGE_SIZE;
+    }
+
+    static inline Arena &arena_of(const Page *page) {
+        return g_arenas[page_to_pfn(page) / g_arena_span];
+    }
+
+    static inline MigrateType gfp_migratetype(gfp_t flags) {
+        return (flags & GFP_RECLAIMABLE) ? MIGRATE_RECLAIMABLE
+                                         : MIGRATE_UNMOVABLE;
+    }
+
+    static inline MigrateType pageblock_mt(size_t pfn) {
+        return static_cast<MigrateType>(
+            g_pageblock_mt[pfn >> BUDDY_PAGEBLOCK_ORDER]);
+    }
+
+    static inline util::IntrusiveList<Page> &free_list(Arena &arena,
+                                                        Page *page,
+                                                        size_t order) {
+        return arena.free_area[order].lists[pageblock_mt(page_to_pfn(page))];
+    }
+
+    static inline void add_to_free_area(Arena &arena, Page *page,
+                                        size_t order, uint32_t state) {
+        page->flags = Page::PG_BUDDY | (state & Page::STATE_MASK);
+        page->order = static_cast<uint32_t>(order);
+        // Dirty blocks go to the head and zeroed ones to the tail, so a
+        // GFP_ZERO request finds a zeroed block, and any other request a
+        // dirty one, by looking at one end.
+        if (state & Page::PG_ZEROED) {
+            free_list(arena, page, order).push_back(*page);
+        } else {
+            free_list(arena, page, order).push_front(*page);
+        }
+        arena.free_area[order].nr_free++;
+        if (!(state & Page::PG_RELEASED)) {
+            arena.free_resident_pages += size_t{1} << order;
+        }
+    }
+
+    static inline void del_from_free_area(Arena &arena, Page *page,
+                                          size_t order) {
+        auto &list = free_list(arena, page, order);
+        list.erase(typename std::remove_reference_t<decltype(list)>::iterator(
+            page));
+        arena.free_area[order].nr_free--;
+        page->flags &= ~Page::PG_BUDDY;
+        if (!(page->flags & Page::PG_RELEASED)) {
+            arena.free_resident_pages -= size_t{1} << order;
+        }
+    }
+
+    // Take a free block of order `cur` off its list and split it down to
+    // `order`. The upper halves go back to the lists of their own pageblocks.
+    static Page *take_block(Arena &arena, Page *page, size_t cur,
+                            size_t order) {
+        del_from_free_area(arena, page, cur);
+        const uint32_t state = page->flags & Page::STATE_MASK;
+        while (cur > order) {
+            cur--;
+            add_to_free_area(arena, page + (size_t{1} << cur), cur, state);
+        }
+        page->order       = static_cast<uint32_t>(order);
+        page->owner_state = state;
+        return page;
+    }
+
+    // Retype one pageblock, moving the free blocks that start in it.
+    static void move_pageblock(Arena &arena, size_t pb_pfn, MigrateType mt) {
+        const MigrateType old = pageblock_mt(pb_pfn);
+        if (old == mt) {
+            return;
+        }
+        for (size_t pfn = pb_pfn; pfn < pb_pfn + PAGEBLOCK_PAGES;) {
+            Page *page = &g_page_map[pfn];
+            if (!(page->flags & Page::PG_BUDDY)) {
+                pfn++;
+                continue;
+            }
+            auto &from = arena.free_area[page->order].lists[old];
+            from.erase(
+                typename std::remove_reference_t<decltype(from)>::iterator(
+                    page));
+            arena.free_area[page->order].lists[mt].push_front(*page);
+            pfn += size_t{1} << page->order;
+        }
+        g_pageblock_mt[pb_pfn >> BUDDY_PAGEBLOCK_ORDER] = mt;
+        arena.nr_pageblocks[old]--;
+        arena.nr_pageblocks[mt]++;
+    }
+
+    // Free pages in the pageblock at `pb_pfn`, walked as move_pageblock()
+    // walks it. Caller holds arena.lock.
+    static size_t pageblock_free_pages(size_t pb_pfn) {
+        size_t free = 0;
+        for (size_t pfn = pb_pfn; pfn < pb_pfn + PAGEBLOCK_PAGES;) {
+            const Page *page = &g_page_map[pfn];
+            if (!(page->flags & Page::PG_BUDDY)) {
+                pfn++;
+                continue;
+            }
+            free += size_t{1} << page->order;
+            pfn += size_t{1} << page->order;
+        }
+        return free;
+    }
+
+    static inline Page *pick_block(util::IntrusiveList<Page> &list,
+                                   bool zeroed) {
+        if (zeroed && (list.back().flags & Page::PG_ZEROED)) {
+            return &list.back();
+        }
+        return &list.front();
+    }
+
+    // Caller holds arena.lock.
+    static Page *rmqueue_smallest(Arena &arena, size_t order, MigrateType mt,
+                                  bool zeroed) {
+        for (size_t cur = order; cur <= BUDDY_MAX_ORDER; cur++) {
+            auto &list = arena.free_area[cur].lists[mt];
+            if (!list.empty()) {
+                return take_block(arena, pick_block(list, zeroed), cur, order);
+            }
+        }
+        return nullptr;
+    }
+
+    // `mt` has run dry in this arena: steal from another class, largest block
+    // first. A block of at least half a pageblock claims its pageblock(s)
+    // outright, so the classes stay in separate pageblocks rather than
+    // interleaving at small orders. As in Linux, a pageblock is only claimed
+    // while at least half of it is free: one the other class mostly still
+    // uses keeps its type, and the stolen block is taken without retyping.
+    static Page *rmqueue_fallback(Arena &arena, size_t order, MigrateType mt,
+                                  bool zeroed) {
+        for (size_t cur = BUDDY_MAX_ORDER + 1; cur-- > order;) {
+            for (size_t other = 0; other < MIGRATE_TYPES; other++) {
+                auto &list = arena.free_area[cur].lists[other];
+                if (other == mt || list.empty()) {
+                    continue;
+                }
+                Page *page = pick_block(list, zeroed);
+                if (cur >= BUDDY_PAGEBLOCK_ORDER / 2) {
+                    const size_t pfn   = page_to_pfn(page);
+                    const size_t first = align_down(pfn, PAGEBLOCK_PAGES);
+                    const size_t last  = std::max(pfn + (size_t{1} << cur),
+                                                  first + PAGEBLOCK_PAGES);
+                    for (size_t pb = first; pb < last; pb += PAGEBLOCK_PAGES) {
+                        if (pageblock_free_pages(pb) >= PAGEBLOCK_PAGES / 2) {
+                            move_pageblock(arena, pb, mt);
+                        }
+                    }
+                }
+                return take_block(arena, page, cur, order);
+            }
+        }
+        return nullptr;
+    }
+
+    // Take a block of exactly `order` for class `mt`, splitting a larger one
+    // if needed; `zeroed` prefers an already zeroed block. Caller holds
+    // arena.lock.
+    static Page *rmqueue(Arena &arena, size_t order, MigrateType mt,
+                         bool zeroed) {
+        Page *page = rmqueue_smallest(arena, order, mt, zeroed);
+        if (!page) {
+            page = rmqueue_fallback(arena, order, mt, zeroed);
+        }
+        if (page) {
+            page->owner_migratetype = mt;
+        }
+        return page;
+    }
+
+    // Ask the shrinkers for `nr_pages` pages. What they free lands in this
+    // thread's page cache, which is drained so it counts. One thread reclaims
+    // at a time, and a shrinker that allocates does not reclaim again.
+    static size_t reclaim(size_t nr_pages) {
+        if (t_in_reclaim) {
+            return 0;
+        }
+        std::unique_lock<std::mutex> guard(g_shrinker_lock, std::try_to_lock);
+        if (!guard.owns_lock()) {
+            return 0;
+        }
+        t_in_reclaim = true;
+        size_t freed = 0;
+        for (BuddyShrinker &shrinker : g_shrinkers) {
+            if (freed >= nr_pages) {
+                break;
+            }
+            freed += shrinker.shrink(shrinker.ctx, nr_pages - freed);
+        }
+        t_pcp.drain();
+        t_in_reclaim = false;
+        return freed;
+    }
+
+    // Charge `count` blocks of `pages` pages. Crossing the high watermark
+    // first runs the shrinkers down to the low one. Returns how many blocks
+    // fit under the limit.
+    static size_t charge_pages(size_t pages, size_t count) {
+        const size_t limit = g_budget_limit.load(std::memory_order_relaxed);
+        const size_t high  = g_budget_high.load(std::memory_order_relaxed);
+        if (limit == 0 && high == 0) {
+            g_used_pages.fetch_add(pages * count, std::memory_order_relaxed);
+            return count;
+        }
+        const size_t mark = high ? high : limit;
+        size_t used       = g_used_pages.load(std::memory_order_relaxed);
+        if (used + pages * count > mark) {
+            const size_t low = g_budget_low.load(std::memory_order_relaxed);
+            reclaim(used + pages * count - (low ? std::min(low, mark) : mark));
+            used = g_used_pages.load(std::memory_order_relaxed);
+        }
+        size_t fit = count;
+        do {
+            if (limit) {
+                fit = std::min(count, used < limit ? (limit - used) / pages : 0);
+                if (fit == 0) {
+                    return 0;
+                }
+            }
+        } while (!g_used_pages.compare_exchange_weak(
+            used, used + fit * pages, std::memory_order_relaxed));
+        return fit;
+    }
+
+    static inline void uncharge_pages(size_t pages) {
+        if (pages) {
+            g_used_pages.fetch_sub(pages, std::memory_order_relaxed);
+        }
+    }
+
+    // Fill `out` with up to `count` blocks, starting with the calling thread's
+    // arena and stealing from the others once it runs dry.
+    static size_t rmqueue_bulk(size_t order, MigrateType mt, size_t count,
+                               Page **out, bool zeroed = false) {
+        count = charge_pages(size_t{1} << order, count);
+        if (count == 0) {
+            return 0;
+        }
+        const size_t home = t_arena_id % g_nr_arenas;
+        size_t got        = 0;
+        for (size_t i = 0; i < g_nr_arenas && got < count; i++) {
+            Arena &arena = g_arenas[(home + i) % g_nr_arenas];
+            std::lock_guard<std::mutex> guard(arena.lock);
+            while (got < count) {
+                Page *page = rmqueue(arena, order, mt, zeroed);
+                if (!page) {
+                    break;
+                }
+                out[got++] = page;
+            }
+        }
+        uncharge_pages((count - got) << order);
+        return got;
+    }
+
+    // madvise() a free block away. DONTNEED guarantees zero-fill on the next
+    // touch; FREE leaves the content undefined until the kernel reclaims it.
+    static bool release_block(Arena &arena, Page *page, size_t order) {
+        void *addr         = pfn_to_virt(page_to_pfn(page));
+        const size_t bytes = PAGE_SIZE << order;
+        uint32_t state     = Page::PG_RELEASED | Page::PG_ZEROED;
+#ifdef MADV_FREE
+        if (arena.release.lazy && madvise(addr, bytes, MADV_FREE) == 0) {
+            state = Page::PG_RELEASED;
+        } else
+#endif
+        if (madvise(addr, bytes, MADV_DONTNEED) != 0) {
+            return false;
+        }
+        page->flags |= state;
+        arena.free_resident_pages -= size_t{1} << order;
+        return true;
+    }
+
+    // Return a block, coalescing with its buddy as long as the buddy is free
+    // and of the same order. A merged block keeps a state bit only if both
+    // halves had it; a partly released block counts as resident again.
+    // Caller holds arena.lock.
+    static void free_one(Arena &arena, Page *page, size_t order,
+                         uint32_t state) {
+        size_t pfn = page_to_pfn(page);
+        while (order < BUDDY_MAX_ORDER) {
+            size_t buddy_pfn = pfn ^ (size_t{1} << order);
+            Page *buddy      = &g_page_map[buddy_pfn];
+            if (!(buddy->flags & Page::PG_BUDDY) || buddy->order != order) {
+                break;
+            }
+            state &= buddy->flags;
+            del_from_free_area(arena, buddy, order);
+            pfn &= ~(size_t{1} << order);
+            order++;
+        }
+        Page *head = &g_page_map[pfn];
+        add_to_free_area(arena, head, order, state);
+        if (order >= arena.release.min_order &&
+            !(state & Page::PG_RELEASED) &&
+            arena.free_resident_pages > arena.release.retain_pages)
+        {
+            release_block(arena, head, order);
+        }
+    }
+
+    // Free a run of blocks, taking each arena lock once for every stretch of
+    // consecutive blocks that belong to it.
+    static void free_bulk(Page **pages, size_t count, size_t order) {
+        uncharge_pages(count << order);
+        size_t i = 0;
+        while (i < count) {
+            Arena &arena = arena_of(pages[i]);
+            std::lock_guard<std::mutex> guard(arena.lock);
+            for (; i < count && &arena_of(pages[i]) == &arena; i++) {
+                free_one(arena, pages[i], order, pages[i]->owner_state);
+            }
+        }
+    }
+
+    static constexpr size_t pcp_batch(size_t order) {
+        return std::max<size_t>(BUDDY_PCP_BATCH >> order, 1);
+    }
+
+    static constexpr size_t pcp_high(size_t order) {
+        return std::max<size_t>(BUDDY_PCP_HIGH >> order, 1);
+    }
+
+    // Move up to `count` of the coldest pages of one list back to the free
+    // lists.
+    static void pcp_drain(MigrateType mt, size_t order, size_t count) {
+        auto &list = t_pcp.lists[mt][order];
+        Page *batch[BUDDY_PCP_HIGH];
+        while (count > 0 && !list.empty()) {
+            size_t n = 0;
+            for (; n < count && n < BUDDY_PCP_HIGH && !list.empty(); n++) {
+                batch[n] = &list.back();
+                list.pop_back();
+            }
+            free_bulk(batch, n, order);
+            count -= n;
+        }
+    }
+
+    void PerCpuPages::drain() {
+        for (size_t mt = 0; mt < MIGRATE_TYPES; mt++) {
+            for (size_t order = 0; order <= BUDDY_PCP_MAX_ORDER; order++) {
+                pcp_drain(static_cast<MigrateType>(mt), order,
+                          lists[mt][order].size());
+            }
+        }
+    }
+
+    static std::atomic<bool> g_prezero_running{false};
+
+    static Page *pcp_alloc(size_t order, MigrateType mt, gfp_t flags) {
+        auto &list = t_pcp.lists[mt][order];
+        // Cached pages are almost always dirty. While the prezero worker
+        // runs, a zeroed block from the arena is worth the lock round trip.
+        if ((flags & GFP_ZERO) &&
+            g_prezero_running.load(std::memory_order_relaxed) &&
+            (list.empty() || !(list.front().owner_state & Page::PG_ZEROED)))
+        {
+            Page *page = nullptr;
+            if (rmqueue_bulk(order, mt, 1, &page, true) == 1) {
+                return page;
+            }
+        }
+        if (list.empty()) {
+            Page *batch[BUDDY_PCP_BATCH];
+            const size_t got =
+                rmqueue_bulk(order, mt, pcp_batch(order), batch);
+            for (size_t i = 0; i < got; i++) {
+                list.push_back(*batch[i]);
+            }
+            if (list.empty()) {
+                return nullptr;
+            }
+        }
+        Page *page = &list.front();
+        list.pop_front();
+        return page;
+    }
+
+    // Freed pages go to the hot end; the cold end is drained in a batch once
+    // the list grows past its high mark.
+    static void pcp_free(Page *page, size_t order) {
+        const auto mt = static_cast<MigrateType>(page->owner_migratetype);
+        auto &list    = t_pcp.lists[mt][order];
+        list.push_front(*page);
+        if (list.size() > pcp_high(order)) {
+            pcp_drain(mt, order, pcp_batch(order));
+        }
+    }
+
+#if defined(__x86_64__)
+    // Non-temporal stores write around the cache, so zeroing a large run does
+    // not evict the caller's working set. Runs are page aligned and a whole
+    // number of pages, so every store is aligned and the loops need no tail.
+    __attribute__((target("avx2"))) static void zero_stream_avx2(void *ptr,
+                                                                 size_t bytes) {
+        auto *dst          = static_cast<__m256i *>(ptr);
+        const __m256i zero = _mm256_setzero_si256();
+        for (size_t i = 0; i < bytes / sizeof(__m256i); i += 4) {
+            _mm256_stream_si256(dst + i, zero);
+            _mm256_stream_si256(dst + i + 1, zero);
+            _mm256_stream_si256(dst + i + 2, zero);
+            _mm256_stream_si256(dst + i + 3, zero);
+        }
+        // Order the weakly ordered stores before the block is handed out.
+        _mm_sfence();
+    }
+
+    static void zero_stream_sse2(void *ptr, size_t bytes) {
+        auto *dst          = static_cast<__m128i *>(ptr);
+        const __m128i zero = _mm_setzero_si128();
+        for (size_t i = 0; i < bytes / sizeof(__m128i); i += 4) {
+            _mm_stream_si128(dst + i, zero);
+            _mm_stream_si128(dst + i + 1, zero);
+            _mm_stream_si128(dst + i + 2, zero);
+            _mm_stream_si128(dst + i + 3, zero);
+        }
+        _mm_sfence();
+    }
+#endif
+
+    using zero_fn = void (*)(void *, size_t);
+
+    static zero_fn select_stream_zero() {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return zero_stream_avx2;
+        }
+        // SSE2 is part of the x86-64 baseline.
+        return zero_stream_sse2;
+#else
+        return nullptr;
+#endif
+    }
+
+    // Zero a run of whole pages. Small runs are likely to be used right
+    // away and are cheapest to zero in cache.
+    static void zero_pages(void *ptr, size_t bytes) {
+        static const zero_fn stream_zero = select_stream_zero();
+        if (bytes >= BUDDY_STREAM_ZERO_BYTES && stream_zero) {
+            stream_zero(ptr, bytes);
+        } else {
+            std::memset(ptr, 0, bytes);
+        }
+    }
+
+    // Background zeroing of free blocks. The worker takes a dirty, resident
+    // block off the free lists, zeroes it without the arena lock and frees
+    // it back as zeroed. Arenas whose lock is contended are skipped for the
+    // pass, so the worker only runs against idle arenas.
+    struct PrezeroWorker {
+        std::thread thread;  // started and joined under g_init_lock
+        std::mutex lock;     // guards stop
+        std::condition_variable wake;
+        bool stop = false;
+        std::atomic<size_t> zeroed_pages{0};
+
+        void run(std::chrono::milliseconds interval);
+        bool zero_one(Arena &arena);
+        ~PrezeroWorker() {
+            Buddy::stop_prezero();
+        }
+    };
+
+    static PrezeroWorker g_prezero;
+
+    // Largest dirty block first: it is the least likely to merge with a
+    // dirty buddy and lose its zeroed state again.
+    bool PrezeroWorker::zero_one(Arena &arena) {
+        std::unique_lock<std::mutex> guard(arena.lock, std::try_to_lock);
+        if (!guard.owns_lock()) {
+            return false;
+        }
+        for (size_t order = BUDDY_MAX_ORDER + 1; order-- > 0;) {
+            for (auto &list : arena.free_area[order].lists) {
+                // Dirty blocks are at the head and zeroed ones at the tail,
+                // but release_block() leaves a block where it is. Step over
+                // released blocks: zeroing one would fault its pages back in,
+                // and a dirty resident block may still sit behind it.
+                Page *page = nullptr;
+                for (Page &block : list) {
+                    if (block.flags & Page::PG_RELEASED) {
+                        continue;
+                    }
+                    if (!(block.flags & Page::PG_ZEROED)) {
+                        page = &block;
+                    }
+                    break;
+                }
+                if (!page) {
+                    continue;
+                }
+                del_from_free_area(arena, page, order);
+                guard.unlock();
+                zero_pages(pfn_to_virt(page_to_pfn(page)), PAGE_SIZE << order);
+                zeroed_pages.fetch_add(size_t{1} << order,
+                                       std::memory_order_relaxed);
+                guard.lock();
+                free_one(arena, page, order, Page::PG_ZEROED);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void PrezeroWorker::run(std::chrono::milliseconds interval) {
+        std::unique_lock<std::mutex> guard(lock);
+        while (!stop) {
+            guard.unlock();
+            bool progress = false;
+            for (size_t i = 0; i < g_nr_arenas; i++) {
+                progress |= zero_one(g_arenas[i]);
+            }
+            guard.lock();
+            if (!progress) {
+                wake.wait_for(guard, interval, [this] { return stop; });
+            }
+        }
+    }
+
+    static void *map_anonymous(size_t bytes) {
+        void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        return p == MAP_FAILED ? nullptr : p;
+    }
+
+    // Without MAP_NORESERVE the mapping fails up front when the hugetlbfs
+    // pool is too small, instead of raising SIGBUS on a later fault.
+    static void *map_hugetlb(size_t bytes) {
+#ifdef MAP_HUGETLB
+        void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        return p == MAP_FAILED ? nullptr : p;
+#else
+        (void)bytes;
+        return nullptr;
+#endif
+    }
+
+    // Each arena retains its share of the global retain budget. With huge
+    // pages, releasing less than a huge page would split (THP) or fail
+    // (hugetlb), so smaller blocks are never released.
+    static void apply_release_policy(Arena &arena) {
+        arena.release = g_release_policy;
+        arena.release.retain_pages /= g_nr_arenas;
+        // Locked or caller-owned memory stays resident.
+        if (g_static_region || g_locked) {
+            arena.release.min_order = BUDDY_MAX_ORDER + 1;
+        }
+        if (g_huge_mode != HugePageMode::NONE) {
+            arena.release.min_order =
+                std::max(arena.release.min_order, BUDDY_HUGE_PAGE_ORDER);
+        }
+    }
+
+    // Where init() puts the arenas and their descriptors.
+    struct ArenaLayout {
+        std::uintptr_t base  = 0;
+        size_t span_bytes    = 0;
+        Page *page_map       = nullptr;
+        uint8_t *mt_map      = nullptr;
+        SlabHeader *slab_map = nullptr;
+        HugePageMode mode    = HugePageMode::NONE;
+        uint32_t state       = 0;  // state of every block to begin with
+    };
+
+    static bool map_arenas(const BuddyConfig &config, size_t bytes,
+                           size_t nr_arenas, ArenaLayout &layout) {
+        // Every arena spans a whole number of max-order blocks.
+        const size_t span_bytes =
+            align_up(bytes / nr_arenas, BUDDY_BLOCK_BYTES);
+        if (span_bytes == 0) {
+            return false;
+        }
+        const size_t arena_bytes = span_bytes * nr_arenas;
+
+        // Over-reserve by one block so the base can be aligned to the largest
+        // order; every block then comes back naturally aligned to its size,
+        // and every huge page of the arena is fully usable.
+        const size_t reserve = arena_bytes + BUDDY_BLOCK_BYTES;
+        HugePageMode mode    = config.huge_pages;
+        void *raw            = nullptr;
+        if (mode == HugePageMode::HUGETLB) {
+            raw = map_hugetlb(reserve);
+            if (!raw) {
+                mode = HugePageMode::TRANSPARENT;
+            }
+        }
+        if (!raw) {
+            raw = map_anonymous(reserve);
+        }
+        if (!raw) {
+            return false;
+        }
+        auto raw_base = reinterpret_cast<std::uintptr_t>(raw);
+        auto base     = align_up(raw_base, BUDDY_BLOCK_BYTES);
+        if (base > raw_base) {
+            munmap(raw, base - raw_base);
+        }
+        auto tail = raw_base + reserve - (base + arena_bytes);
+        if (tail > 0) {
+            munmap(reinterpret_cast<void *>(base + arena_bytes), tail);
+        }
+#ifdef MADV_HUGEPAGE
+        if (mode == HugePageMode::TRANSPARENT &&
+            madvise(reinterpret_cast<void *>(base), arena_bytes,
+                    MADV_HUGEPAGE) != 0)
+        {
+            mode = HugePageMode::NONE;
+        }
+#else
+        if (mode == HugePageMode::TRANSPARENT) {
+            mode = HugePageMode::NONE;
+        }
+#endif
+
+        const size_t nr_pages      = arena_bytes / PAGE_SIZE;
+        const size_t nr_pageblocks = nr_pages / PAGEBLOCK_PAGES;
+        void *map                  = map_anonymous(nr_pages * sizeof(Page));
+        // Zero is MIGRATE_UNMOVABLE: every pageblock starts out unmovable.
+        void *mt_map = map ? map_anonymous(nr_pageblocks) : nullptr;
+        void *slab_map =
+            mt_map ? map_anonymous(nr_pages * sizeof(SlabHeader)) : nullptr;
+        if (!slab_map ||
+            (config.lock_pages &&
+             mlock(reinterpret_cast<void *>(base), arena_bytes) != 0))
+        {
+            if (map) {
+                munmap(map, nr_pages * sizeof(Page));
+            }
+            if (mt_map) {
+                munmap(mt_map, nr_pageblocks);
+            }
+            if (slab_map) {
+                munmap(slab_map, nr_pages * sizeof(SlabHeader));
+            }
+            munmap(reinterpret_cast<void *>(base), arena_bytes);
+            return false;
+        }
+
+        layout.base       = base;
+        layout.span_bytes = span_bytes;
+        layout.mode       = mode;
+        // A zero-filled mapping is already a valid array of idle
+        // descriptors; leave it untouched so it is faulted in lazily.
+        layout.page_map = static_cast<Page *>(map);
+        layout.mt_map   = static_cast<uint8_t *>(mt_map);
+        layout.slab_map = static_cast<SlabHeader *>(slab_map);
+        // Fresh anonymous memory reads as zero and has no RAM behind it,
+        // unless it was just locked in.
+        layout.state = config.lock_pages ? Page::PG_ZEROED
+                                         : Page::PG_ZEROED | Page::PG_RELEASED;
+        return true;
+    }
+
+    // Lay the arenas out in the caller's region: max-order blocks from the
+    // first block boundary on, then their descriptors in the remainder.
+    static bool carve_region(const BuddyConfig &config, size_t &nr_arenas,
+                             ArenaLayout &layout) {
+        constexpr size_t block_pages = BUDDY_BLOCK_BYTES / PAGE_SIZE;
+        constexpr size_t block_cost  = BUDDY_BLOCK_BYTES +
+                                      block_pages * sizeof(Page) +
+                                      block_pages / PAGEBLOCK_PAGES +
+                                      block_pages * sizeof(SlabHeader);
+        const auto start = reinterpret_cast<std::uintptr_t>(config.region);
+        const auto end   = start + config.region_bytes;
+        const auto base  = align_up(start, BUDDY_BLOCK_BYTES);
+        if (base + alignof(Page) + alignof(SlabHeader) >= end) {
+            return false;
+        }
+        size_t nr_blocks =
+            (end - base - alignof(Page) - alignof(SlabHeader)) / block_cost;
+        nr_arenas        = std::min(nr_arenas, nr_blocks);
+        if (nr_arenas == 0) {
+            return false;
+        }
+        nr_blocks -= nr_blocks % nr_arenas;
+
+        const size_t arena_bytes = nr_blocks * BUDDY_BLOCK_BYTES;
+        const size_t nr_pages    = arena_bytes / PAGE_SIZE;
+        auto *map = reinterpret_cast<Page *>(
+            align_up(base + arena_bytes, alignof(Page)));
+        auto *mt_map = reinterpret_cast<uint8_t *>(map + nr_pages);
+        auto *slab_map = reinterpret_cast<SlabHeader *>(
+            align_up(reinterpret_cast<std::uintptr_t>(mt_map) +
+                         nr_pages / PAGEBLOCK_PAGES,
+                     alignof(SlabHeader)));
+        if (config.lock_pages && mlock(config.region, config.region_bytes) != 0)
+        {
+            return false;
+        }
+        // The region may hold anything, and touching it now is the point.
+        std::memset(static_cast<void *>(map), 0, nr_pages * sizeof(Page));
+        std::memset(mt_map, 0, nr_pages / PAGEBLOCK_PAGES);
+        std::memset(static_cast<void *>(slab_map), 0,
+                    nr_pages * sizeof(SlabHeader));
+
+        layout.base       = base;
+        layout.span_bytes = arena_bytes / nr_arenas;
+        layout.mode       = HugePageMode::NONE;
+        layout.page_map   = map;
+        layout.mt_map     = mt_map;
+        layout.slab_map   = slab_map;
+        layout.state      = 0;
+        return true;
+    }
+
+    // The full reservation may not fit under an address-space limit: halve
+    // it until it does, down to one max-order block per arena.
+    static bool map_arenas_fallback(const BuddyConfig &config,
+                                    size_t nr_arenas, ArenaLayout &layout) {
+        const size_t min_bytes = nr_arenas * BUDDY_BLOCK_BYTES;
+        for (size_t bytes = config.arena_bytes;; bytes /= 2) {
+            if (map_arenas(config, std::max(bytes, min_bytes), nr_arenas,
+                           layout))
+            {
+                return true;
+            }
+            if (bytes <= min_bytes) {
+                return false;
+            }
+        }
+    }
+
+    bool Buddy::init(const BuddyConfig &config) {
+        std::lock_guard<std::mutex> guard(g_init_lock);
+        if (g_ready.load(std::memory_order_relaxed)) {
+            // Too late for another config: the arenas are already in use,
+            // possibly set up by the first allocation.
+            return config == g_config;
+        }
+
+        size_t nr_arenas = config.nr_arenas;
+        if (nr_arenas == 0) {
+            nr_arenas = std::thread::hardware_concurrency();
+        }
+        nr_arenas = std::clamp<size_t>(nr_arenas, 1, BUDDY_MAX_ARENAS);
+        ArenaLayout layout{};
+        if (config.region ? !carve_region(config, nr_arenas, layout)
+                          : !map_arenas_fallback(config, nr_arenas, layout))
+        {
+            return false;
+        }
+
+        g_arena_base    = layout.base;
+        g_arena_pages   = layout.span_bytes * nr_arenas / PAGE_SIZE;
+        g_nr_arenas     = nr_arenas;
+        g_arena_span    = layout.span_bytes / PAGE_SIZE;
+        g_huge_mode     = layout.mode;
+        g_page_map      = layout.page_map;
+        g_pageblock_mt  = layout.mt_map;
+        slab_base_      = layout.base;
+        slab_pages_     = g_arena_pages;
+        slab_map_       = layout.slab_map;
+        g_static_region = config.region != nullptr;
+        g_region        = config.region;
+        g_region_bytes  = config.region_bytes;
+        g_locked        = config.lock_pages;
+        g_config        = config;
+
+        const size_t block_pages = size_t{1} << BUDDY_MAX_ORDER;
+        for (size_t i = 0; i < nr_arenas; i++) {
+            Arena &arena = g_arenas[i];
+            std::lock_guard<std::mutex> arena_guard(arena.lock);
+            apply_release_policy(arena);
+            arena.nr_pageblocks[MIGRATE_UNMOVABLE] =
+                g_arena_span / PAGEBLOCK_PAGES;
+            const size_t start = i * g_arena_span;
+            for (size_t pfn = start + g_arena_span; pfn > start;
+                 pfn -= block_pages)
+            {
+                add_to_free_area(arena, &g_page_map[pfn - block_pages],
+                                 BUDDY_MAX_ORDER, layout.state);
+            }
+        }
+        g_ready.store(true, std::memory_order_release);
+        return true;
+    }
+
+    // Initialise with the default config on first use. A failure is
+    // retried, at most once per INIT_RETRY_INTERVAL_NS.
+    static bool ensure_init() {
+        if (g_ready.load(std::memory_order_acquire)) [[likely]] {
+            return true;
+        }
+        const int64_t now =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+        if (now < g_init_retry_ns.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        if (!Buddy::init()) {
+            g_init_retry_ns.store(now + INIT_RETRY_INTERVAL_NS,
+                                  std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    // Turn a block taken off the free lists into the caller's memory.
+    static inline void *prep_new_page(Page *page, size_t order, gfp_t flags) {
+        void *ptr = pfn_to_virt(page_to_pfn(page));
+        if ((flags & GFP_ZERO) && !(page->owner_state & Page::PG_ZEROED)) {
+            zero_pages(ptr, PAGE_SIZE << order);
+        }
+        return ptr;
+    }
+
+    void *Buddy::alloc_pages(size_t pages, gfp_t flags) {
+        const uint64_t start = timing_start();
+        const size_t order   = order_of_pages(pages);
+        void *ptr            = nullptr;
+        if (pages > BUDDY_VMAP_PAGES) {
+            // A fresh mapping is already zero. A static region never maps.
+            if (!g_static_region && charge_pages(pages, 1) == 1) {
+                ptr = map_anonymous(pages * PAGE_SIZE);
+                if (!ptr) {
+                    uncharge_pages(pages);
+                }
+            }
+        } else if (ensure_init()) {
+            const MigrateType mt = gfp_migratetype(flags);
+            Page *page           = nullptr;
+            if (order <= BUDDY_PCP_MAX_ORDER) {
+                page = pcp_alloc(order, mt, flags);
+            } else {
+                rmqueue_bulk(order, mt, 1, &page, flags & GFP_ZERO);
+            }
+            ptr   = page ? prep_new_page(page, order, flags) : nullptr;
+            pages = size_t{1} << order;
+        }
         if (!ptr)
             return nullptr;
-        std::memset(ptr, 0, bytes);
 
-        g_total_pages += pages;
-        g_current_pages += pages;
-        g_buddy_alloc_count++;
-
-        auto end = std::chrono::high_resolution_clock::now();
-        g_buddy_alloc_time_ms += std::chrono::duration<double, std::milli>(end - start).count();
+        stat_add(STAT_ALLOC_PAGES, pages);
+        stat_add(STAT_ALLOC_COUNT, 1);
+        timing_end(STAT_ALLOC_NS, start);
 
         return ptr;
     }
 
+    size_t Buddy::alloc_pages_bulk(size_t pages, size_t count, void **out,
+                                   gfp_t flags) {
+        const uint64_t start = timing_start();
+        const size_t order   = order_of_pages(pages);
+        size_t got           = 0;
+        if (pages > BUDDY_VMAP_PAGES) {
+            const size_t fit = g_static_region ? 0 : charge_pages(pages, count);
+            for (; got < fit; got++) {
+                out[got] = map_anonymous(pages * PAGE_SIZE);
+                if (!out[got]) {
+                    break;
+                }
+            }
+            uncharge_pages((fit - got) * pages);
+        } else if (ensure_init()) {
+            pages                = size_t{1} << order;
+            const MigrateType mt = gfp_migratetype(flags);
+            // Use up what this thread already caches, then take the rest
+            // straight from the arenas, one lock round trip per arena.
+            if (order <= BUDDY_PCP_MAX_ORDER) {
+                auto &list = t_pcp.lists[mt][order];
+                for (; got < count && !list.empty(); got++) {
+                    Page *page = &list.front();
+                    list.pop_front();
+                    out[got] = prep_new_page(page, order, flags);
+                }
+            }
+            Page *batch[BUDDY_PCP_HIGH];
+            while (got < count) {
+                const size_t want = std::min(count - got, BUDDY_PCP_HIGH);
+                const size_t n =
+                    rmqueue_bulk(order, mt, want, batch, flags & GFP_ZERO);
+                for (size_t i = 0; i < n; i++) {
+                    out[got++] = prep_new_page(batch[i], order, flags);
+                }
+                if (n < want) {
+                    break;
+                }
+            }
+        }
+        if (got == 0)
+            return 0;
+
+        stat_add(STAT_ALLOC_PAGES, got * pages);
+        stat_add(STAT_ALLOC_COUNT, 1);
+        timing_end(STAT_ALLOC_NS, start);
+
+        return got;
+    }
+
     void Buddy::free_pages(void *ptr, size_t pages) {
         if (ptr) {
-            auto start = std::chrono::high_resolution_clock::now();
-            std::free(ptr);
-            g_current_pages -= pages;
-            g_buddy_free_count++;
-            auto end = std::chrono::high_resolution_clock::now();
-            g_buddy_free_time_ms += std::chrono::duration<double, std::milli>(end - start).count();
+            free_pages_bulk(&ptr, 1, pages);
+        }
+    }
+
+    void Buddy::free_pages_bulk(void **ptrs, size_t count, size_t pages) {
+        const uint64_t start = timing_start();
+        const size_t order   = order_of_pages(pages);
+        size_t freed         = 0;
+        if (pages > BUDDY_VMAP_PAGES) {
+            for (size_t i = 0; i < count; i++) {
+                if (ptrs[i]) {
+                    munmap(ptrs[i], pages * PAGE_SIZE);
+                    freed++;
+                }
+            }
+            uncharge_pages(freed * pages);
+        } else {
+            pages = size_t{1} << order;
+            Page *batch[BUDDY_PCP_HIGH];
+            size_t n = 0;
+            for (size_t i = 0; i < count; i++) {
+                if (!ptrs[i]) {
+                    continue;
+                }
+                assert(virt_to_pfn(ptrs[i]) < g_arena_pages);
+                Page *page        = &g_page_map[virt_to_pfn(ptrs[i])];
+                page->owner_state = 0;
+                freed++;
+                if (order <= BUDDY_PCP_MAX_ORDER) {
+                    pcp_free(page, order);
+                    continue;
+                }
+                batch[n++] = page;
+                if (n == BUDDY_PCP_HIGH) {
+                    free_bulk(batch, n, order);
+                    n = 0;
+                }
+            }
+            free_bulk(batch, n, order);
+        }
+        if (freed == 0)
+            return;
+
+        stat_add(STAT_FREE_PAGES, freed * pages);
+        stat_add(STAT_FREE_COUNT, 1);
+        timing_end(STAT_FREE_NS, start);
+    }
+
+    void *Buddy::realloc_pages(void *ptr, size_t old_pages, size_t new_pages,
+                               gfp_t flags) {
+        if (!ptr) {
+            return alloc_pages(new_pages, flags);
+        }
+        if (new_pages == 0) {
+            free_pages(ptr, old_pages);
+            return nullptr;
+        }
+        if (old_pages > BUDDY_VMAP_PAGES && new_pages > BUDDY_VMAP_PAGES) {
+            // The kernel moves the page tables, never the data, and grown
+            // anonymous memory reads as zero.
+            if (new_pages > old_pages &&
+                charge_pages(new_pages - old_pages, 1) == 0)
+            {
+                return nullptr;
+            }
+            void *moved = mremap(ptr, old_pages * PAGE_SIZE,
+                                 new_pages * PAGE_SIZE, MREMAP_MAYMOVE);
+            if (moved == MAP_FAILED) {
+                if (new_pages > old_pages) {
+                    uncharge_pages(new_pages - old_pages);
+                }
+                return nullptr;
+            }
+            if (new_pages > old_pages) {
+                stat_add(STAT_ALLOC_PAGES, new_pages - old_pages);
+            } else {
+                uncharge_pages(old_pages - new_pages);
+                stat_add(STAT_FREE_PAGES, old_pages - new_pages);
+            }
+            return moved;
+        }
+        if (old_pages <= BUDDY_VMAP_PAGES && new_pages <= BUDDY_VMAP_PAGES &&
+            order_of_pages(old_pages) == order_of_pages(new_pages))
+        {
+            // Still fits the block it already has.
+            if ((flags & GFP_ZERO) && new_pages > old_pages) {
+                std::memset(static_cast<char *>(ptr) + old_pages * PAGE_SIZE,
+                            0, (new_pages - old_pages) * PAGE_SIZE);
+            }
+            return ptr;
+        }
+        void *moved = alloc_pages(new_pages, flags);
+        if (moved) {
+            std::memcpy(moved, ptr, std::min(old_pages, new_pages) * PAGE_SIZE);
+            free_pages(ptr, old_pages);
+        }
+        return moved;
+    }
+
+    void Buddy::drain_local_pages() {
+        t_pcp.drain();
+    }
+
+    void Buddy::shutdown() {
+        stop_prezero();
+        drain_local_pages();
+        std::lock_guard<std::mutex> guard(g_init_lock);
+        g_init_retry_ns.store(0, std::memory_order_relaxed);
+        if (!g_ready.load(std::memory_order_relaxed)) {
+            return;
+        }
+        g_ready.store(false, std::memory_order_relaxed);
+        for (size_t i = 0; i < g_nr_arenas; i++) {
+            Arena &arena = g_arenas[i];
+            std::lock_guard<std::mutex> arena_guard(arena.lock);
+            for (FreeArea &area : arena.free_area) {
+                for (auto &list : area.lists) {
+                    list.clear();
+                }
+                area.nr_free = 0;
+            }
+            for (size_t &count : arena.nr_pageblocks) {
+                count = 0;
+            }
+            arena.free_resident_pages = 0;
+        }
+        if (g_static_region) {
+            if (g_locked) {
+                munlock(g_region, g_region_bytes);
+            }
+        } else {
+            munmap(reinterpret_cast<void *>(g_arena_base),
+                   g_arena_pages * PAGE_SIZE);
+            munmap(g_page_map, g_arena_pages * sizeof(Page));
+            munmap(g_pageblock_mt, g_arena_pages / PAGEBLOCK_PAGES);
+            munmap(slab_map_, g_arena_pages * sizeof(SlabHeader));
+        }
+        g_arena_base    = 0;
+        g_arena_pages   = 0;
+        g_nr_arenas     = 0;
+        g_arena_span    = 0;
+        g_page_map      = nullptr;
+        g_pageblock_mt  = nullptr;
+        slab_base_      = 0;
+        slab_pages_     = 0;
+        slab_map_       = nullptr;
+        g_static_region = false;
+        g_locked        = false;
+        g_used_pages.store(0, std::memory_order_relaxed);
+    }
+
+    bool Buddy::start_prezero(unsigned interval_ms) {
+        if (!ensure_init()) {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(g_init_lock);
+        if (!g_prezero.thread.joinable()) {
+            const std::chrono::milliseconds interval(interval_ms);
+            g_prezero.stop   = false;
+            g_prezero.thread = std::thread([interval] { g_prezero.run(interval); });
+            g_prezero_running.store(true, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    void Buddy::stop_prezero() {
+        std::lock_guard<std::mutex> guard(g_init_lock);
+        if (!g_prezero.thread.joinable()) {
+            return;
         }
+        {
+            std::lock_guard<std::mutex> stop_guard(g_prezero.lock);
+            g_prezero.stop = true;
+        }
+        g_prezero_running.store(false, std::memory_order_relaxed);
+        g_prezero.wake.notify_one();
+        g_prezero.thread.join();
+    }
+
+    size_t Buddy::get_prezeroed_pages() {
+        return g_prezero.zeroed_pages.load(std::memory_order_relaxed);
+    }
+
+    void Buddy::set_budget(const BuddyBudget &budget) {
+        g_budget_low.store(budget.low_pages, std::memory_order_relaxed);
+        g_budget_high.store(budget.high_pages, std::memory_order_relaxed);
+        g_budget_limit.store(budget.limit_pages, std::memory_order_relaxed);
+    }
+
+    BuddyBudget Buddy::get_budget() {
+        return {g_budget_limit.load(std::memory_order_relaxed),
+                g_budget_high.load(std::memory_order_relaxed),
+                g_budget_low.load(std::memory_order_relaxed)};
+    }
+
+    size_t Buddy::get_used_pages() {
+        return g_used_pages.load(std::memory_order_relaxed);
+    }
+
+    void Buddy::register_shrinker(BuddyShrinker &shrinker) {
+        std::lock_guard<std::mutex> guard(g_shrinker_lock);
+        g_shrinkers.push_back(shrinker);
+    }
+
+    void Buddy::unregister_shrinker(BuddyShrinker &shrinker) {
+        std::lock_guard<std::mutex> guard(g_shrinker_lock);
+        // Unlinked already if the registry was torn down at exit first.
+        if (shrinker.next) {
+            g_shrinkers.erase(
+                typename decltype(g_shrinkers)::iterator(&shrinker));
+        }
+    }
+
+    size_t Buddy::shrink(size_t nr_pages) {
+        return reclaim(nr_pages);
+    }
+
+    void Buddy::set_release_policy(const BuddyReleasePolicy &policy) {
+        std::lock_guard<std::mutex> guard(g_init_lock);
+        g_release_policy = policy;
+        for (size_t i = 0; i < g_nr_arenas; i++) {
+            std::lock_guard<std::mutex> arena_guard(g_arenas[i].lock);
+            apply_release_policy(g_arenas[i]);
+        }
+    }
+
+    size_t Buddy::release_free_pages(size_t keep_pages) {
+        if (!g_ready.load(std::memory_order_acquire) || g_static_region ||
+            g_locked)
+        {
+            return 0;
+        }
+        size_t released   = 0;
+        const size_t keep = keep_pages / g_nr_arenas;
+        // Never split a huge page, even on request.
+        const size_t min_order =
+            g_huge_mode != HugePageMode::NONE ? BUDDY_HUGE_PAGE_ORDER : 0;
+        for (size_t i = 0; i < g_nr_arenas; i++) {
+            Arena &arena = g_arenas[i];
+            std::lock_guard<std::mutex> guard(arena.lock);
+            // Largest blocks first: fewest syscalls per released page.
+            for (size_t order = BUDDY_MAX_ORDER + 1; order-- > min_order;) {
+                for (auto &list : arena.free_area[order].lists) {
+                    for (Page &page : list) {
+                        if (arena.free_resident_pages <= keep) {
+                            break;
+                        }
+                        if (!(page.flags & Page::PG_RELEASED) &&
+                            release_block(arena, &page, order))
+                        {
+                            released += size_t{1} << order;
+                        }
+                    }
+                }
+            }
+        }
+        return released;
+    }
+
+    size_t Buddy::get_free_resident_pages() {
+        if (!g_ready.load(std::memory_order_acquire)) {
+            return 0;
+        }
+        size_t pages = 0;
+        for (size_t i = 0; i < g_nr_arenas; i++) {
+            std::lock_guard<std::mutex> guard(g_arenas[i].lock);
+            pages += g_arenas[i].free_resident_pages;
+        }
+        return pages;
+    }
+
+    HugePageMode Buddy::get_huge_page_mode() {
+        return g_ready.load(std::memory_order_acquire) ? g_huge_mode
+                                                        : HugePageMode::NONE;
+    }
+
+    // Caller holds arena.lock.
+    static void collect_buddyinfo(const Arena &arena, BuddyInfo &info) {
+        for (size_t order = 0; order <= BUDDY_MAX_ORDER; order++) {
+            const size_t nr_free = arena.free_area[order].nr_free;
+            info.nr_free[order] += nr_free;
+            info.free_pages += nr_free << order;
+            if (nr_free > 0) {
+                info.largest_free_order =
+                    std::max(info.largest_free_order, static_cast<int>(order));
+            }
+        }
+        for (size_t mt = 0; mt < MIGRATE_TYPES; mt++) {
+            info.nr_pageblocks[mt] += arena.nr_pageblocks[mt];
+        }
+        info.free_resident_pages += arena.free_resident_pages;
+    }
+
+    BuddyInfo Buddy::get_buddyinfo() {
+        BuddyInfo info{};
+        for (size_t i = 0; i < get_nr_arenas(); i++) {
+            std::lock_guard<std::mutex> guard(g_arenas[i].lock);
+            collect_buddyinfo(g_arenas[i], info);
+        }
+        return info;
+    }
+
+    BuddyInfo Buddy::get_buddyinfo(size_t arena) {
+        BuddyInfo info{};
+        if (arena < get_nr_arenas()) {
+            std::lock_guard<std::mutex> guard(g_arenas[arena].lock);
+            collect_buddyinfo(g_arenas[arena], info);
+        }
+        return info;
+    }
+
+    size_t Buddy::get_nr_arenas() {
+        return g_ready.load(std::memory_order_acquire) ? g_nr_arenas : 0;
     }
 
     size_t Buddy::get_current_pages() {
-        return g_current_pages;
+        std::lock_guard<std::mutex> guard(g_stats_lock);
+        return stat_total(STAT_ALLOC_PAGES) - stat_total(STAT_FREE_PAGES);
     }
 
     size_t Buddy::get_total_allocated_pages() {
-        return g_total_pages;
+        return stat_sum(STAT_ALLOC_PAGES);
     }
 
     double Buddy::get_alloc_time_ms() {
-        return g_buddy_alloc_time_ms;
+        return stat_sum(STAT_ALLOC_NS) / 1e6;
     }
 
     double Buddy::get_free_time_ms() {
-        return g_buddy_free_time_ms;
+        return stat_sum(STAT_FREE_NS) / 1e6;
     }
 
     size_t Buddy::get_alloc_count() {
-        return g_buddy_alloc_count;
+        return stat_sum(STAT_ALLOC_COUNT);
     }
 
     size_t Buddy::get_free_count() {
-        return g_buddy_free_count;
+        return stat_sum(STAT_FREE_COUNT);
     }
 
     void Buddy::reset_timers() {
-        g_buddy_alloc_time_ms = 0;
-        g_buddy_free_time_ms = 0;
-        g_buddy_alloc_count = 0;
-        g_buddy_free_count = 0;
+        std::lock_guard<std::mutex> guard(g_stats_lock);
+        for (BuddyStat item : {STAT_ALLOC_COUNT, STAT_FREE_COUNT,
+                               STAT_ALLOC_NS, STAT_FREE_NS})
+        {
+            g_stats_base[item] = stat_total(item);
+        }
+    }
+
+    void Buddy::set_timing(bool enabled) {
+#if SLUB_BUDDY_TIMING
+        g_timing.store(enabled, std::memory_order_relaxed);
+#else
+        (void)enabled;
+#endif
+    }
+
+    bool Buddy::timing_enabled() {
+#if SLUB_BUDDY_TIMING
+        return g_timing.load(std::memory_order_relaxed);
+#else
+        return false;
+#endif
+    }
+
+    // The page's descriptor leads to the slab, or page run, and that to its
+    // cache.
+    static SlabCache *cache_of(const void *ptr) {
+        const SlabHeader *desc = ptr ? Buddy::virt_to_slab(ptr) : nullptr;
+        const SlabHeader *head = desc ? desc->head : nullptr;
+        return head ? head->cache : nullptr;
+    }
+
+    void kfree(void *ptr) {
+        SlabCache *cache = cache_of(ptr);
+        if (!cache) {
+            printf("kfree: %p is not a cache object\n", ptr);
+            return;
+        }
+        cache->free(cache->ctx, ptr);
+    }
+
+    size_t ksize(const void *ptr) {
+        const SlabCache *cache = cache_of(ptr);
+        return cache ? cache->object_size : 0;
     }
 }  // namespace slub
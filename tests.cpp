@@ -1,9 +1,36 @@
 #include "slub.h"
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <cassert>
+#include <cstdlib>
 #include <cstring>
+#include <mutex>
 #include <random>
+#include <thread>
+
+// Page source for Test 16: a small static pool, handed out a page at a time
+// and never reused.
+struct FixedPages {
+    static constexpr size_t NR_PAGES = 4;
+    alignas(slub::PAGE_SIZE) static inline std::byte
+        pool[NR_PAGES * slub::PAGE_SIZE];
+    static inline size_t used = 0;
+
+    static void *alloc_pages(size_t pages, slub::gfp_t) {
+        if (pages != 1 || used == NR_PAGES) {
+            return nullptr;
+        }
+        return pool + used++ * slub::PAGE_SIZE;
+    }
+    static void free_pages(void *, size_t) {}
+};
 
 int main() {
     using namespace slub;
@@ -21,6 +48,10 @@ int main() {
         std::byte payload[3000];
     };
 
+    struct HugeObj {
+        std::byte payload[SLAB_KMAX];
+    };
+
     std::cout << "[Test 1] Basic Alignment Helpers" << std::endl;
     assert(align_up(1, 8) == 8);
     assert(align_up(8, 8) == 8);
@@ -65,12 +96,54 @@ int main() {
 
     std::cout << "[Test 4] Big Type Path Alloc/Free" << std::endl;
     {
+        // Below SLAB_KMAX, several objects share a multi-page slab.
+        static_assert(!HugeObjectType<BigObj> && HugeObjectType<HugeObj>);
+        // Whatever the concept sends to slabs, SlabGeometry must accept,
+        // with or without an on-slab header.
+        static_assert([] {
+            for (size_t size = 1; size < SLAB_KMAX; size++) {
+                for (size_t header : {size_t{0}, sizeof(SlabHeader)}) {
+                    if (!slab_suits(size, 1, header)) {
+                        continue;
+                    }
+                    const size_t obj   = slab_obj_size(size, 1);
+                    const size_t align = slab_obj_align(1);
+                    const size_t order = calculate_order(obj, align, header);
+                    const size_t bytes = PAGE_SIZE << order;
+                    const size_t objects =
+                        slab_objects(order, obj, align, header);
+                    const size_t first = (header + align - 1) & ~(align - 1);
+                    if (order > SLUB_MAX_ORDER || objects == 0 ||
+                        bytes - first - objects * obj > bytes / 4)
+                    {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }());
+        struct OddObj {
+            char payload[10921];
+        };
+        SlubAllocator<OddObj> odd;
+        odd.free(odd.alloc());
         SlubAllocator<BigObj> alloc;
         void *p = alloc.alloc();
-        assert(p != nullptr);
-        assert(reinterpret_cast<uintptr_t>(p) % PAGE_SIZE == 0);
+        void *q = alloc.alloc();
+        assert(p != nullptr && q != nullptr);
         std::memset(p, 0xAB, sizeof(BigObj));
+        std::memset(q, 0xCD, sizeof(BigObj));
+        const SlubStats stats = alloc.get_stats();
+        assert(stats.objects_total / stats.total_slabs > 2);
         alloc.free(p);
+        alloc.free(q);
+
+        SlubAllocator<HugeObj> huge;
+        void *h = huge.alloc();
+        assert(h != nullptr);
+        assert(reinterpret_cast<uintptr_t>(h) % PAGE_SIZE == 0);
+        std::memset(h, 0xAB, sizeof(HugeObj));
+        huge.free(h);
     }
     std::cout << "  Passed." << std::endl;
 
@@ -104,6 +177,842 @@ int main() {
     }
     std::cout << "  Passed." << std::endl;
 
+    std::cout << "[Test 6] Buddy Split/Merge" << std::endl;
+    {
+        const size_t before = Buddy::get_current_pages();
+        void *a = Buddy::alloc_pages(1);
+        void *b = Buddy::alloc_pages(3);
+        void *c = Buddy::alloc_pages(16);
+        assert(a && b && c);
+        assert(reinterpret_cast<uintptr_t>(b) % (4 * PAGE_SIZE) == 0);
+        assert(reinterpret_cast<uintptr_t>(c) % (16 * PAGE_SIZE) == 0);
+        assert(Buddy::get_current_pages() == before + 1 + 4 + 16);
+
+        Buddy::free_pages(a, 1);
+        Buddy::free_pages(b, 3);
+        Buddy::free_pages(c, 16);
+        assert(Buddy::get_current_pages() == before);
+
+        // Everything merged back: the same max-order block is handed out again.
+        void *big = Buddy::alloc_pages(size_t{1} << BUDDY_MAX_ORDER);
+        assert(big != nullptr);
+        assert(reinterpret_cast<uintptr_t>(big) % BUDDY_BLOCK_BYTES == 0);
+        Buddy::free_pages(big, size_t{1} << BUDDY_MAX_ORDER);
+
+        // Oversized runs bypass the arena.
+        const size_t huge_pages = (size_t{1} << BUDDY_MAX_ORDER) + 1;
+        void *huge = Buddy::alloc_pages(huge_pages);
+        assert(huge != nullptr);
+        std::memset(huge, 0x5A, huge_pages * PAGE_SIZE);
+        Buddy::free_pages(huge, huge_pages);
+        assert(Buddy::get_current_pages() == before);
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 7] Buddy Zeroed-On-Demand" << std::endl;
+    {
+        // Small runs are zeroed in cache, large ones with streaming stores.
+        for (size_t pages : {size_t{2}, BUDDY_STREAM_ZERO_BYTES / PAGE_SIZE}) {
+            auto *p = static_cast<unsigned char *>(Buddy::alloc_pages(pages));
+            assert(p != nullptr);
+            std::memset(p, 0xEE, pages * PAGE_SIZE);
+            Buddy::free_pages(p, pages);
+
+            auto *z = static_cast<unsigned char *>(
+                Buddy::alloc_pages(pages, GFP_ZERO));
+            assert(z != nullptr);
+            for (size_t i = 0; i < pages * PAGE_SIZE; ++i) {
+                assert(z[i] == 0);
+            }
+            Buddy::free_pages(z, pages);
+        }
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 8] Buddy Per-Thread Page Cache" << std::endl;
+    {
+        const size_t before = Buddy::get_current_pages();
+        void *p = Buddy::alloc_pages(1);
+        assert(p != nullptr);
+        Buddy::free_pages(p, 1);
+        // A freed order-0 page is cached hot and handed straight back.
+        void *q = Buddy::alloc_pages(1);
+        assert(q == p);
+        Buddy::free_pages(q, 1);
+
+        std::vector<void *> pages;
+        for (size_t i = 0; i < 4 * BUDDY_PCP_HIGH; ++i) {
+            pages.push_back(Buddy::alloc_pages(1));
+            assert(pages.back() != nullptr);
+        }
+        for (void *page : pages) {
+            Buddy::free_pages(page, 1);
+        }
+        Buddy::drain_local_pages();
+        assert(Buddy::get_current_pages() == before);
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 9] Buddy Release To OS" << std::endl;
+    {
+        BuddyReleasePolicy keep_all;
+        keep_all.retain_pages = SIZE_MAX;
+        Buddy::set_release_policy(keep_all);
+
+        const size_t block_pages = size_t{1} << BUDDY_MAX_ORDER;
+        auto *p = static_cast<unsigned char *>(Buddy::alloc_pages(block_pages));
+        assert(p != nullptr);
+        std::memset(p, 0x77, block_pages * PAGE_SIZE);
+        const size_t resident = Buddy::get_free_resident_pages();
+        Buddy::free_pages(p, block_pages);
+        assert(Buddy::get_free_resident_pages() == resident + block_pages);
+
+        // Blocks smaller than a huge page stay resident when the arena is
+        // huge-page backed, so only the freed block is sure to go.
+        assert(Buddy::release_free_pages(0) >= block_pages);
+        assert(Buddy::get_free_resident_pages() <= resident);
+
+        // Released with MADV_DONTNEED, so known to read back as zero.
+        auto *z = static_cast<unsigned char *>(
+            Buddy::alloc_pages(block_pages, GFP_ZERO));
+        assert(z != nullptr);
+        assert(z[0] == 0 && z[block_pages * PAGE_SIZE - 1] == 0);
+        Buddy::free_pages(z, block_pages);
+
+        Buddy::set_release_policy(BuddyReleasePolicy{});
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 10] Buddy Concurrent Alloc/Free" << std::endl;
+    {
+        const size_t before = Buddy::get_current_pages();
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([t] {
+                std::mt19937 gen(t);
+                std::uniform_int_distribution<size_t> pages_dist(1, 20);
+                std::vector<std::pair<unsigned char *, size_t>> held;
+                for (int i = 0; i < 20000; ++i) {
+                    if (held.size() < 64 && (gen() & 1)) {
+                        size_t pages = pages_dist(gen);
+                        auto *p = static_cast<unsigned char *>(
+                            Buddy::alloc_pages(pages));
+                        assert(p != nullptr);
+                        std::memset(p, t, pages * PAGE_SIZE);
+                        held.emplace_back(p, pages);
+                    } else if (!held.empty()) {
+                        auto [p, pages] = held.back();
+                        held.pop_back();
+                        assert(p[0] == t && p[pages * PAGE_SIZE - 1] == t);
+                        Buddy::free_pages(p, pages);
+                    }
+                }
+                for (auto [p, pages] : held) {
+                    Buddy::free_pages(p, pages);
+                }
+            });
+        }
+        for (auto &th : threads) {
+            th.join();
+        }
+        assert(Buddy::get_current_pages() == before);
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 11] Buddy Bulk Alloc/Free" << std::endl;
+    {
+        const size_t before = Buddy::get_current_pages();
+        for (size_t pages : {size_t{1}, size_t{2}, size_t{32}}) {
+            std::vector<void *> blocks(100);
+            size_t got = Buddy::alloc_pages_bulk(pages, blocks.size(),
+                                                 blocks.data());
+            assert(got == blocks.size());
+            std::vector<void *> sorted(blocks);
+            std::sort(sorted.begin(), sorted.end());
+            assert(std::adjacent_find(sorted.begin(), sorted.end()) ==
+                   sorted.end());
+            for (void *b : blocks) {
+                const size_t block = PAGE_SIZE << order_of_pages(pages);
+                assert(reinterpret_cast<uintptr_t>(b) % block == 0);
+            }
+            assert(Buddy::get_current_pages() == before + 100 * pages);
+            Buddy::free_pages_bulk(blocks.data(), blocks.size(), pages);
+            assert(Buddy::get_current_pages() == before);
+        }
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 12] Buddy Fragmentation Report" << std::endl;
+    {
+        Buddy::drain_local_pages();
+        BuddyInfo info = Buddy::get_buddyinfo();
+        assert(info.largest_free_order == static_cast<int>(BUDDY_MAX_ORDER));
+        assert(info.fragmentation_index(BUDDY_MAX_ORDER) == -1);
+        size_t free_pages = 0;
+        for (size_t a = 0; a < Buddy::get_nr_arenas(); ++a) {
+            free_pages += Buddy::get_buddyinfo(a).free_pages;
+        }
+        assert(free_pages == info.free_pages);
+
+        void *p = Buddy::alloc_pages(size_t{1} << BUDDY_MAX_ORDER);
+        assert(Buddy::get_buddyinfo().free_pages ==
+               info.free_pages - (size_t{1} << BUDDY_MAX_ORDER));
+        Buddy::free_pages(p, size_t{1} << BUDDY_MAX_ORDER);
+
+        // 100 scattered single pages cannot serve an order-1 request.
+        BuddyInfo frag{};
+        frag.nr_free[0]         = 100;
+        frag.free_pages         = 100;
+        frag.largest_free_order = 0;
+        assert(std::abs(frag.fragmentation_index(1) - 0.49) < 1e-9);
+        assert(BuddyInfo{}.fragmentation_index(0) == 0);
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 13] Buddy Migrate Types" << std::endl;
+    {
+        const size_t pageblock = PAGE_SIZE << BUDDY_PAGEBLOCK_ORDER;
+        BuddyInfo info         = Buddy::get_buddyinfo();
+        const size_t total     = info.nr_pageblocks[MIGRATE_UNMOVABLE] +
+                                 info.nr_pageblocks[MIGRATE_RECLAIMABLE];
+
+        std::vector<void *> reclaimable(64), unmovable(64);
+        for (void *&p : reclaimable) {
+            p = Buddy::alloc_pages(1, GFP_RECLAIMABLE);
+            assert(p);
+        }
+        for (void *&p : unmovable) {
+            p = Buddy::alloc_pages(1);
+            assert(p);
+        }
+        // The two classes never share a pageblock.
+        for (void *r : reclaimable) {
+            for (void *u : unmovable) {
+                assert(reinterpret_cast<uintptr_t>(r) / pageblock !=
+                       reinterpret_cast<uintptr_t>(u) / pageblock);
+            }
+        }
+        info = Buddy::get_buddyinfo();
+        assert(info.nr_pageblocks[MIGRATE_RECLAIMABLE] > 0);
+        assert(info.nr_pageblocks[MIGRATE_UNMOVABLE] +
+                   info.nr_pageblocks[MIGRATE_RECLAIMABLE] ==
+               total);
+
+        for (void *p : reclaimable) Buddy::free_pages(p, 1);
+        for (void *p : unmovable) Buddy::free_pages(p, 1);
+        Buddy::drain_local_pages();
+        assert(Buddy::get_buddyinfo().largest_free_order ==
+               static_cast<int>(BUDDY_MAX_ORDER));
+
+        // A pageblock the other class mostly uses is not claimed. Buddy is
+        // set up once per process, so use a small region in a child.
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            Buddy::shutdown();
+            const size_t bytes = 3 * BUDDY_BLOCK_BYTES;
+            BuddyConfig config{};
+            config.nr_arenas    = 1;
+            config.region       = std::aligned_alloc(BUDDY_BLOCK_BYTES, bytes);
+            config.region_bytes = bytes;
+            [[maybe_unused]] const bool ready = Buddy::init(config);
+            assert(ready);
+            const size_t pb_pages = size_t{1} << BUDDY_PAGEBLOCK_ORDER;
+            const size_t nr_pb =
+                Buddy::get_buddyinfo().nr_pageblocks[MIGRATE_UNMOVABLE];
+            // Every pageblock but the last whole, then all but 32 pages of
+            // the last, leaving one free order-5 block.
+            for (size_t i = 0; i + 1 < nr_pb; i++) {
+                [[maybe_unused]] void *p = Buddy::alloc_pages(pb_pages);
+                assert(p);
+            }
+            for (size_t pages = pb_pages / 2; pages >= 32; pages /= 2) {
+                [[maybe_unused]] void *p = Buddy::alloc_pages(pages);
+                assert(p);
+            }
+            [[maybe_unused]] void *stolen = Buddy::alloc_pages(
+                16, GFP_RECLAIMABLE);
+            assert(stolen);
+            assert(Buddy::get_buddyinfo().nr_pageblocks[MIGRATE_RECLAIMABLE] ==
+                   0);
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 14] Buddy Background Prezeroing" << std::endl;
+    {
+        const size_t pages = 32;
+        std::vector<void *> blocks(16);
+        for (void *&p : blocks) {
+            p = Buddy::alloc_pages(pages);
+            assert(p);
+            memset(p, 0x5A, pages * PAGE_SIZE);
+        }
+        for (void *p : blocks) Buddy::free_pages(p, pages);
+
+        const size_t before = Buddy::get_prezeroed_pages();
+        [[maybe_unused]] const bool started = Buddy::start_prezero(1);
+        assert(started);
+        for (int i = 0; i < 1000 && Buddy::get_prezeroed_pages() == before;
+             ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        assert(Buddy::get_prezeroed_pages() > before);
+
+        for (void *&p : blocks) {
+            p = Buddy::alloc_pages(pages, GFP_ZERO);
+            assert(p);
+            auto *bytes = static_cast<unsigned char *>(p);
+            for (size_t i = 0; i < pages * PAGE_SIZE; i += 64) {
+                assert(bytes[i] == 0);
+            }
+        }
+        Buddy::stop_prezero();
+        Buddy::stop_prezero();
+        for (void *p : blocks) Buddy::free_pages(p, pages);
+
+        // A block released with MADV_FREE stays dirty at the head of its
+        // list; the worker must step over it to the dirty block behind.
+        // Fresh blocks are clean, so that block is the only one to zero.
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            Buddy::shutdown();
+            BuddyConfig config{};
+            config.arena_bytes = BUDDY_BLOCK_BYTES;
+            config.nr_arenas   = 1;
+            config.huge_pages  = HugePageMode::NONE;
+            [[maybe_unused]] const bool ready = Buddy::init(config);
+            assert(ready);
+            BuddyReleasePolicy keep_all;
+            keep_all.retain_pages = SIZE_MAX;
+            Buddy::set_release_policy(keep_all);
+
+            const size_t order_pages = 16;
+            std::vector<void *> quads(4);
+            for (void *&p : quads) {
+                p = Buddy::alloc_pages(order_pages);
+                assert(p);
+                memset(p, 0x5A, order_pages * PAGE_SIZE);
+            }
+            // Free one of each buddy pair so nothing merges.
+            Buddy::free_pages(quads[0], order_pages);
+            BuddyReleasePolicy lazy;
+            lazy.min_order    = 4;
+            lazy.retain_pages = 0;
+            lazy.lazy         = true;
+            Buddy::set_release_policy(lazy);
+            Buddy::free_pages(quads[2], order_pages);
+
+            const size_t before = Buddy::get_prezeroed_pages();
+            [[maybe_unused]] const bool worker = Buddy::start_prezero(1);
+            assert(worker);
+            for (int i = 0;
+                 i < 1000 &&
+                 Buddy::get_prezeroed_pages() < before + order_pages;
+                 ++i)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            Buddy::stop_prezero();
+            assert(Buddy::get_prezeroed_pages() >= before + order_pages);
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 15] Buddy Budget And Shrinkers" << std::endl;
+    {
+        Buddy::drain_local_pages();
+        SlubAllocator<SmallObj> alloc;
+        std::vector<void *> objs;
+        for (int i = 0; i < 1000; ++i) {
+            objs.push_back(alloc.alloc());
+        }
+        for (void *p : objs) alloc.free(p);
+        const size_t slabs = alloc.get_stats().total_slabs;
+        assert(slabs > 0);
+
+        // Crossing the high mark makes the allocator give its empty slabs
+        // back before the request is served.
+        const size_t used = Buddy::get_used_pages();
+        Buddy::set_budget({used + 64, used + 16, used - slabs});
+        void *p = Buddy::alloc_pages(32);
+        assert(p != nullptr);
+        assert(alloc.get_stats().total_slabs == 0);
+        assert(Buddy::get_used_pages() == used - slabs + 32);
+
+        // Past the limit, and with nothing left to shrink, requests fail.
+        assert(Buddy::alloc_pages(64) == nullptr);
+        void *q = Buddy::alloc_pages(16);
+        assert(q != nullptr);
+        Buddy::free_pages(q, 16);
+        Buddy::set_budget({});
+        q = Buddy::alloc_pages(64);
+        assert(q != nullptr);
+        Buddy::free_pages(q, 64);
+        Buddy::free_pages(p, 32);
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 16] Custom Page Provider" << std::endl;
+    {
+        SlubAllocator<SmallObj, FixedPages> alloc;
+        const auto base = reinterpret_cast<uintptr_t>(FixedPages::pool);
+        const size_t buddy_before = Buddy::get_total_allocated_pages();
+        std::vector<void *> objs;
+        while (void *p = alloc.alloc()) {
+            const auto addr = reinterpret_cast<uintptr_t>(p);
+            assert(addr >= base && addr < base + sizeof(FixedPages::pool));
+            objs.push_back(p);
+        }
+        // The pool, not Buddy, backed every slab.
+        assert(FixedPages::used == FixedPages::NR_PAGES);
+        assert(Buddy::get_total_allocated_pages() == buddy_before);
+        assert(alloc.get_stats().total_slabs == FixedPages::NR_PAGES);
+        for (void *p : objs) alloc.free(p);
+        assert(alloc.get_stats().objects_inuse == 0);
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 17] Buddy In A Caller's Region" << std::endl;
+    {
+        // Buddy is initialised once per process, so re-init in a child.
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            // Room for two blocks; their descriptors take part of the third.
+            const size_t bytes = 3 * BUDDY_BLOCK_BYTES;
+            void *region = std::aligned_alloc(BUDDY_BLOCK_BYTES, bytes);
+            BuddyConfig config{};
+            config.nr_arenas    = 1;
+            config.region       = region;
+            config.region_bytes = bytes;
+            // The earlier tests' first allocation already set Buddy up.
+            [[maybe_unused]] const bool late   = Buddy::init(config);
+            [[maybe_unused]] const bool same   = Buddy::init();
+            Buddy::shutdown();
+            [[maybe_unused]] const bool fresh  = Buddy::init(config);
+            [[maybe_unused]] const bool repeat = Buddy::init(config);
+            assert(!late && same && fresh && repeat);
+
+            const auto base = reinterpret_cast<uintptr_t>(region);
+            std::vector<void *> pages;
+            while (void *p = Buddy::alloc_pages(1)) {
+                const auto addr = reinterpret_cast<uintptr_t>(p);
+                assert(addr >= base && addr < base + bytes);
+                pages.push_back(p);
+            }
+            assert(pages.size() == 2 * BUDDY_BLOCK_BYTES / PAGE_SIZE);
+            // Nothing is ever mapped, even above the largest order.
+            assert(Buddy::alloc_pages(4 * BUDDY_BLOCK_BYTES / PAGE_SIZE) ==
+                   nullptr);
+            for (void *p : pages) Buddy::free_pages(p, 1);
+            Buddy::drain_local_pages();
+            assert(Buddy::get_buddyinfo().nr_free[BUDDY_MAX_ORDER] == 2);
+            assert(Buddy::release_free_pages() == 0);
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 18] Buddy Realloc" << std::endl;
+    {
+        auto fill = [](void *p, size_t pages) {
+            auto *words = static_cast<size_t *>(p);
+            for (size_t i = 0; i < pages * PAGE_SIZE / sizeof(size_t);
+                 i += 512) {
+                words[i] = i;
+            }
+        };
+        auto check = [](void *p, size_t pages) {
+            auto *words = static_cast<size_t *>(p);
+            for (size_t i = 0; i < pages * PAGE_SIZE / sizeof(size_t);
+                 i += 512) {
+                assert(words[i] == i);
+            }
+        };
+        const size_t before = Buddy::get_current_pages();
+
+        // Within one buddy block nothing moves.
+        void *p = Buddy::alloc_pages(3);
+        fill(p, 3);
+        [[maybe_unused]] void *same = Buddy::realloc_pages(p, 3, 4);
+        assert(same == p);
+        // From the arenas to a direct mapping is a copy.
+        void *q = Buddy::realloc_pages(p, 4, 2 * BUDDY_VMAP_PAGES);
+        assert(q != nullptr);
+        check(q, 3);
+        fill(q, 2 * BUDDY_VMAP_PAGES);
+        // Directly mapped runs are remapped, and grown pages read as zero.
+        p = Buddy::realloc_pages(q, 2 * BUDDY_VMAP_PAGES,
+                                 8 * BUDDY_VMAP_PAGES);
+        assert(p != nullptr);
+        check(p, 2 * BUDDY_VMAP_PAGES);
+        auto *tail = static_cast<unsigned char *>(p) +
+                     2 * BUDDY_VMAP_PAGES * PAGE_SIZE;
+        assert(tail[0] == 0 && tail[6 * BUDDY_VMAP_PAGES * PAGE_SIZE - 1] == 0);
+        assert(Buddy::get_current_pages() == before + 8 * BUDDY_VMAP_PAGES);
+        p = Buddy::realloc_pages(p, 8 * BUDDY_VMAP_PAGES,
+                                 2 * BUDDY_VMAP_PAGES);
+        check(p, 2 * BUDDY_VMAP_PAGES);
+        p = Buddy::realloc_pages(p, 2 * BUDDY_VMAP_PAGES, 0);
+        assert(p == nullptr);
+        assert(Buddy::get_current_pages() == before);
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 19] Shared Cache Across Threads" << std::endl;
+    {
+        // More threads than cpu slots, so slots are shared.
+        constexpr int THREADS = static_cast<int>(SLUB_CPU_SLOTS) + 4;
+        constexpr int PER_THREAD = 20000;
+        SlubAllocator<SmallObj> alloc;
+        std::vector<std::vector<void *>> objs(THREADS);
+
+        auto run = [&](auto body) {
+            std::vector<std::thread> threads;
+            for (int t = 0; t < THREADS; ++t) {
+                threads.emplace_back(body, t);
+            }
+            for (auto &th : threads) th.join();
+        };
+        run([&](int t) {
+            for (int i = 0; i < PER_THREAD; ++i) {
+                void *p = alloc.alloc();
+                assert(p != nullptr);
+                std::memset(p, t, sizeof(SmallObj));
+                objs[t].push_back(p);
+            }
+        });
+        std::vector<void *> all;
+        for (auto &v : objs) all.insert(all.end(), v.begin(), v.end());
+        std::sort(all.begin(), all.end());
+        assert(std::adjacent_find(all.begin(), all.end()) == all.end());
+        assert(alloc.get_stats().objects_inuse == THREADS * PER_THREAD);
+
+        // Every object goes back through another thread's slot.
+        run([&](int t) {
+            for (void *p : objs[(t + 1) % THREADS]) alloc.free(p);
+        });
+        assert(alloc.get_stats().objects_inuse == 0);
+
+        run([&](int t) {
+            std::mt19937 gen(t);
+            std::vector<void *> mine;
+            for (int i = 0; i < PER_THREAD; ++i) {
+                if (gen() % 3 != 0 || mine.empty()) {
+                    mine.push_back(alloc.alloc());
+                } else {
+                    alloc.free(mine.back());
+                    mine.pop_back();
+                }
+            }
+            for (void *p : mine) alloc.free(p);
+        });
+        assert(alloc.get_stats().objects_inuse == 0);
+
+        // Producer/consumer pairs: odd threads free what even threads
+        // allocate, while the producers keep allocating from those slabs.
+        std::vector<std::mutex> locks(THREADS / 2);
+        std::vector<std::vector<void *>> queues(THREADS / 2);
+        std::atomic<int> producing{THREADS / 2};
+        run([&](int t) {
+            auto &lock = locks[t / 2];
+            auto &queue = queues[t / 2];
+            if (t % 2 == 0) {
+                for (int i = 0; i < PER_THREAD; ++i) {
+                    void *p = alloc.alloc();
+                    assert(p != nullptr);
+                    std::lock_guard<std::mutex> guard(lock);
+                    queue.push_back(p);
+                }
+                producing--;
+                return;
+            }
+            for (bool last = false; !last;) {
+                last = producing == 0;
+                std::vector<void *> batch;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    batch.swap(queue);
+                }
+                for (void *p : batch) alloc.free(p);
+                if (batch.empty()) std::this_thread::yield();
+            }
+        });
+        assert(alloc.get_stats().objects_inuse == 0);
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 20] Cpu Partial Slabs" << std::endl;
+    for (size_t budget : {size_t{0}, size_t{2}, SLUB_CPU_PARTIAL_SLABS}) {
+        SlubAllocator<SmallObj> alloc;
+        alloc.set_cpu_partial(budget);
+        std::vector<void *> ptrs{alloc.alloc()};
+        const SlubStats first = alloc.get_stats();
+        const size_t per_slab = first.objects_total / first.total_slabs;
+        while (ptrs.size() < first.objects_total) {
+            ptrs.push_back(alloc.alloc());
+        }
+
+        // A full slab goes onto the partial list of the thread that frees
+        // to it, which takes those objects before the node's; without a
+        // budget it goes straight to the node. The last slab is still this
+        // thread's active one, so it is left alone.
+        const size_t nr_holes =
+            std::min(std::max(budget, size_t{1}), first.total_slabs - 1);
+        std::vector<void *> holes, again;
+        auto punch = [&] {
+            for (size_t i = 0; i < nr_holes; ++i) {
+                holes.push_back(ptrs[i * per_slab]);
+                alloc.free(ptrs[i * per_slab]);
+                ptrs[i * per_slab] = nullptr;
+            }
+        };
+        auto refill = [&] {
+            for (size_t i = 0; i < nr_holes; ++i) {
+                again.push_back(alloc.alloc());
+            }
+        };
+        if (budget == 0) {
+            std::thread(punch).join();
+            refill();
+        } else {
+            std::thread([&] {
+                punch();
+                refill();
+            }).join();
+        }
+        assert(alloc.get_stats().total_slabs == first.total_slabs);
+        std::sort(holes.begin(), holes.end());
+        std::sort(again.begin(), again.end());
+        assert(holes == again);
+
+        for (void *p : ptrs) {
+            if (p) alloc.free(p);
+        }
+        for (void *p : again) alloc.free(p);
+        assert(alloc.get_stats().objects_inuse == 0);
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 21] Empty Slabs Back To Buddy" << std::endl;
+    {
+        const size_t before = Buddy::get_current_pages();
+        {
+            SlubAllocator<SmallObj> alloc;
+            std::vector<void *> objs;
+            while (alloc.get_stats().total_slabs < 40) {
+                objs.push_back(alloc.alloc());
+            }
+            for (void *p : objs) alloc.free(p);
+            // Past min_partial, drained slabs went back as they emptied;
+            // the slot still holds its active and partial slabs.
+            const SlubStats stats = alloc.get_stats();
+            assert(stats.objects_inuse == 0);
+            assert(stats.total_slabs <=
+                   SLUB_MIN_PARTIAL + 1 + SLUB_CPU_PARTIAL_SLABS);
+            [[maybe_unused]] const size_t freed = alloc.shrink();
+            assert(freed == stats.memory_usage_bytes / PAGE_SIZE);
+            assert(alloc.get_stats().total_slabs == 0);
+
+            alloc.set_min_partial(0);
+            void *p = alloc.alloc();
+            assert(p != nullptr);
+            alloc.free(p);
+            alloc.shrink();
+            assert(alloc.get_stats().total_slabs == 0);
+            objs.assign(1000, nullptr);
+            for (void *&o : objs) o = alloc.alloc();
+            for (void *o : objs) alloc.free(o);
+        }
+        // The destructor gave the rest back.
+        assert(Buddy::get_current_pages() == before);
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 22] Slab Order Per Type" << std::endl;
+    {
+        struct MidObj {
+            std::byte payload[1024];
+        };
+        SlubAllocator<MidObj> alloc;
+        std::vector<void *> objs;
+        for (int i = 0; i < 100; ++i) {
+            objs.push_back(alloc.alloc());
+            std::memset(objs.back(), i, sizeof(MidObj));
+        }
+        // The layout is settled at compile time.
+        using Geometry = SlabGeometry<sizeof(MidObj), alignof(void *), 0>;
+        static_assert(Geometry::order == 1 && Geometry::objects == 8 &&
+                      Geometry::waste == 0 && Geometry::colours == 1);
+        // A multi-page slab keeps its unused tail within 1/16 of it.
+        const SlubStats stats  = alloc.get_stats();
+        const size_t slab_size = stats.memory_usage_bytes / stats.total_slabs;
+        const size_t per_slab  = stats.objects_total / stats.total_slabs;
+        assert(slab_size > PAGE_SIZE);
+        assert(slab_size - per_slab * sizeof(MidObj) <= slab_size / 16);
+        for (int i = 0; i < 100; ++i) {
+            const auto *bytes = static_cast<const unsigned char *>(objs[i]);
+            assert(bytes[0] == i && bytes[sizeof(MidObj) - 1] == i);
+        }
+        for (void *p : objs) alloc.free(p);
+        assert(alloc.get_stats().objects_inuse == 0);
+
+        // Slabs with room to spare start their objects at different
+        // colours.
+        using BigGeometry = SlabGeometry<sizeof(BigObj), alignof(void *), 0>;
+        static_assert(BigGeometry::colours > 1);
+        SlubAllocator<BigObj> big;
+        std::vector<void *> bigs;
+        std::vector<uintptr_t> offsets;
+        for (size_t i = 0; i < 2 * BigGeometry::objects; ++i) {
+            bigs.push_back(big.alloc());
+            offsets.push_back(reinterpret_cast<uintptr_t>(bigs.back()) %
+                              BigGeometry::bytes);
+        }
+        std::sort(offsets.begin(), offsets.end());
+        assert(offsets[0] != offsets[1]);
+        assert(offsets[0] % BigGeometry::colour_off == 0);
+        for (void *p : bigs) big.free(p);
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 23] Off-Slab Descriptors And kfree" << std::endl;
+    {
+        // Buddy keeps the descriptors, so a slab is objects edge to edge;
+        // a provider without them still gives up room to the header.
+        SlubAllocator<SmallObj> small;
+        SlubAllocator<BigObj> big;
+        SlubAllocator<HugeObj> huge;
+        void *s = small.alloc();
+        void *b = big.alloc();
+        void *h = huge.alloc();
+        SlubStats stats = small.get_stats();
+        assert(stats.objects_total * sizeof(SmallObj) ==
+               stats.memory_usage_bytes);
+        stats = big.get_stats();
+        assert(stats.memory_usage_bytes / stats.total_slabs > PAGE_SIZE);
+        assert(!HugeObjectType<std::byte[16 << 10]>);
+        assert((HugeObjectType<std::byte[16 << 10], FixedPages>));
+
+        // kfree() finds the cache from the pointer alone, at any slab order
+        // and from any page of the slab.
+        assert(ksize(s) == sizeof(SmallObj));
+        assert(ksize(b) == sizeof(BigObj));
+        assert(ksize(h) == sizeof(HugeObj));
+        std::vector<void *> objs;
+        for (int i = 0; i < 64; ++i) {
+            objs.push_back(big.alloc());
+        }
+        for (void *p : objs) kfree(p);
+        kfree(s);
+        kfree(b);
+        kfree(h);
+        assert(small.get_stats().objects_inuse == 0);
+        assert(big.get_stats().objects_inuse == 0);
+        assert(huge.get_stats().objects_inuse == 0);
+        assert(ksize(&stats) == 0);
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 24] Reservation Under An Address-Space Limit"
+              << std::endl;
+    {
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            Buddy::shutdown();
+            size_t vm_pages = 0;
+            FILE *statm     = std::fopen("/proc/self/statm", "r");
+            assert(statm);
+            [[maybe_unused]] const int read =
+                std::fscanf(statm, "%zu", &vm_pages);
+            assert(read == 1);
+            std::fclose(statm);
+            const rlim_t vm_bytes = vm_pages * PAGE_SIZE;
+            rlimit limit{};
+            getrlimit(RLIMIT_AS, &limit);
+            const rlim_t hard = limit.rlim_max;
+            [[maybe_unused]] int set = 0;
+
+            // Far too little room for the default reservation: a smaller
+            // one is taken instead.
+            limit.rlim_cur = vm_bytes + (rlim_t{6} << 30);
+            set            = setrlimit(RLIMIT_AS, &limit);
+            assert(set == 0);
+            void *p = Buddy::alloc_pages(1);
+            assert(p != nullptr);
+            Buddy::free_pages(p, 1);
+            Buddy::drain_local_pages();
+            Buddy::shutdown();
+
+            // No room at all: allocations fail, and succeed again once
+            // there is room and the retry interval has passed.
+            limit.rlim_cur = vm_bytes + (rlim_t{1} << 20);
+            set            = setrlimit(RLIMIT_AS, &limit);
+            assert(set == 0);
+            p = Buddy::alloc_pages(1);
+            assert(p == nullptr);
+            limit.rlim_cur = hard;
+            set            = setrlimit(RLIMIT_AS, &limit);
+            assert(set == 0);
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            p = Buddy::alloc_pages(1);
+            assert(p != nullptr);
+            Buddy::free_pages(p, 1);
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    std::cout << "  Passed." << std::endl;
+
+    std::cout << "[Test 25] Shrink While Allocating" << std::endl;
+    {
+        // Flushing unfreezes other slots' slabs under their feet.
+        SlubAllocator<SmallObj> alloc;
+        alloc.set_min_partial(0);
+        std::atomic<bool> stop{false};
+        std::vector<std::thread> workers;
+        for (int t = 0; t < 4; ++t) {
+            workers.emplace_back([&alloc] {
+                std::vector<void *> objs;
+                for (int round = 0; round < 100; ++round) {
+                    for (int i = 0; i < 500; ++i) {
+                        objs.push_back(alloc.alloc());
+                    }
+                    for (void *p : objs) alloc.free(p);
+                    objs.clear();
+                }
+            });
+        }
+        std::thread shrinker([&] {
+            while (!stop.load()) {
+                alloc.shrink();
+                std::this_thread::yield();
+            }
+        });
+        for (auto &worker : workers) worker.join();
+        stop.store(true);
+        shrinker.join();
+        assert(alloc.get_stats().objects_inuse == 0);
+    }
+    std::cout << "  Passed." << std::endl;
+
     std::cout << "All tests passed successfully!" << std::endl;
     return 0;
 }